@@ -0,0 +1,223 @@
+/*
+ *
+ * Copyright (C) 2023 guruthree
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// tracking of heap allocations by the stage of the sync they happen in, built with -DALLOCTRACE=ON
+// malloc and friends are replaced (so this catches libical, curl, and pilot-link as well as new),
+// each allocation is tagged with the stage that made it, and a summary is printed on exit with the
+// allocations, bytes, the peak heap in use during each stage, and what was never freed
+// (glibc only, it relies on being able to call the real malloc as __libc_malloc, and the aligned
+// allocations, posix_memalign, aligned_alloc, and memalign, on __libc_memalign)
+
+// mark the start of a stage of the sync, e.g., ALLOC_STAGE(Parse)
+#ifdef ALLOC_TRACE
+#define ALLOC_STAGE(STAGE) (alloctrace::stage.store(alloctrace::STAGE, std::memory_order_relaxed))
+#else
+#define ALLOC_STAGE(STAGE)
+#endif
+
+#ifdef ALLOC_TRACE
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/mman.h>
+
+extern "C" {
+    void* __libc_malloc(size_t size);
+    void* __libc_calloc(size_t count, size_t size);
+    void* __libc_realloc(void *ptr, size_t size);
+    void* __libc_memalign(size_t alignment, size_t size);
+    void __libc_free(void *ptr);
+}
+
+namespace alloctrace {
+
+    enum Stage { Startup, Connect, Fetch, Parse, Convert, Prepare, HotSync, Stages };
+    const char *StageNames[Stages] = {"startup", "connect", "fetch", "parse", "convert", "prepare", "hotsync"};
+
+    struct Stats {
+        size_t allocs = 0, frees = 0, bytes = 0, peak = 0, live = 0;
+    };
+
+    // set from the main thread, allocations on other threads (e.g., ParallelFor) count towards it
+    std::atomic<Stage> stage(Startup);
+    Stats stats[Stages];
+    size_t live = 0; // across all stages
+    size_t untracked = 0; // allocations that didn't fit in the table
+
+    // where each allocation is and which stage made it, in an open addressed table mapped directly
+    // (it can't use malloc itself) and only touched as it's used
+    struct Entry {
+        void *ptr;
+        size_t size;
+        Stage stage;
+    };
+    const size_t TableSize = 1 << 22;
+    Entry *table = nullptr;
+    std::atomic_flag lock = ATOMIC_FLAG_INIT;
+
+    size_t slot(void *ptr) {
+        return ((uintptr_t)ptr >> 4) * 11400714819323198485ULL >> (64 - 22);
+    }
+
+    void add(void *ptr, size_t size) {
+        if (ptr == nullptr) {
+            return;
+        }
+        while (lock.test_and_set(std::memory_order_acquire));
+        if (table == nullptr) {
+            void *map = mmap(nullptr, TableSize * sizeof(Entry), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            table = map != MAP_FAILED ? (Entry*)map : nullptr;
+        }
+
+        Stage at = stage.load(std::memory_order_relaxed);
+        size_t i = slot(ptr), probes = 0;
+        while (table != nullptr && table[i].ptr != nullptr && probes < 64) {
+            i = (i + 1) % TableSize;
+            probes++;
+        }
+        if (table != nullptr && table[i].ptr == nullptr) {
+            table[i] = {ptr, size, at};
+            Stats &s = stats[at];
+            s.allocs++;
+            s.bytes += size;
+            s.live += size;
+            live += size;
+            if (live > s.peak) {
+                s.peak = live;
+            }
+        }
+        else {
+            untracked++;
+        }
+        lock.clear(std::memory_order_release);
+    }
+
+    // returns the size of the allocation, 0 if it wasn't tracked
+    size_t remove(void *ptr) {
+        size_t size = 0;
+        if (ptr == nullptr) {
+            return size;
+        }
+        while (lock.test_and_set(std::memory_order_acquire));
+        size_t i = slot(ptr);
+        for (size_t probes = 0; table != nullptr && table[i].ptr != nullptr && probes < 64; probes++) {
+            if (table[i].ptr == ptr) {
+                Stats &s = stats[table[i].stage];
+                size = table[i].size;
+                s.frees++;
+                s.live -= size;
+                live -= size;
+
+                // close the gap so later entries in the same run can still be found
+                size_t gap = i;
+                for (size_t j = (i + 1) % TableSize; table[j].ptr != nullptr; j = (j + 1) % TableSize) {
+                    size_t home = slot(table[j].ptr);
+                    if ((j > gap && (home <= gap || home > j)) || (j < gap && home <= gap && home > j)) {
+                        table[gap] = table[j];
+                        gap = j;
+                    }
+                }
+                table[gap].ptr = nullptr;
+                break;
+            }
+            i = (i + 1) % TableSize;
+        }
+        lock.clear(std::memory_order_release);
+        return size;
+    }
+
+    void report() {
+        fprintf(stderr, "\n    ==> Heap allocations <==\n");
+        fprintf(stderr, "    stage        allocs      frees      bytes MB    peak MB   leaked MB\n");
+        for (int i = 0; i < Stages; i++) {
+            fprintf(stderr, "    %-8s %10zu %10zu %12.2f %10.2f %11.2f\n", StageNames[i], stats[i].allocs, stats[i].frees,
+                stats[i].bytes / 1048576.0, stats[i].peak / 1048576.0, stats[i].live / 1048576.0);
+        }
+        if (untracked > 0) {
+            fprintf(stderr, "    (%zu allocations couldn't be tracked)\n", untracked);
+        }
+        fprintf(stderr, "\n");
+    }
+
+    // report when the program exits, however that happens (apart from _exit)
+    struct Reporter {
+        Reporter() {
+            atexit(report);
+        }
+    } reporter;
+}
+
+extern "C" {
+    void* malloc(size_t size) {
+        void *ptr = __libc_malloc(size);
+        alloctrace::add(ptr, size);
+        return ptr;
+    }
+
+    void* calloc(size_t count, size_t size) {
+        void *ptr = __libc_calloc(count, size);
+        alloctrace::add(ptr, count * size);
+        return ptr;
+    }
+
+    void* realloc(void *old, size_t size) {
+        size_t oldsize = alloctrace::remove(old);
+        void *ptr = __libc_realloc(old, size);
+        if (ptr == nullptr && old != nullptr && size > 0) {
+            alloctrace::add(old, oldsize); // still there, though now counted as this stage's
+        }
+        alloctrace::add(ptr, size);
+        return ptr;
+    }
+
+    void* memalign(size_t alignment, size_t size) {
+        void *ptr = __libc_memalign(alignment, size);
+        alloctrace::add(ptr, size);
+        return ptr;
+    }
+
+    void* aligned_alloc(size_t alignment, size_t size) {
+        return memalign(alignment, size);
+    }
+
+    int posix_memalign(void **ptr, size_t alignment, size_t size) {
+        // the alignment has to be a power of two multiple of sizeof(void*)
+        if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0) {
+            return EINVAL;
+        }
+        void *aligned = memalign(alignment, size);
+        if (aligned == nullptr && size > 0) {
+            return ENOMEM;
+        }
+        *ptr = aligned;
+        return 0;
+    }
+
+    void free(void *ptr) {
+        alloctrace::remove(ptr);
+        __libc_free(ptr);
+    }
+}
+
+#endif
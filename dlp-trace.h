@@ -0,0 +1,128 @@
+/*
+ *
+ * Copyright (C) 2023 guruthree
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// optional tracing of the calls made to the palm, to find out where the time goes during a sync
+// each call is timed and the bytes sent and received recorded (record and block data only, the
+// DLP headers aren't counted), with a summary per call printed at the end and optionally a trace file
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// make a call to the palm through the trace, e.g., DLP(dlp_WriteRecord(sd, db, ...), length, 0)
+// SENT and RECEIVED are evaluated after the call, so can refer to buffers the call filled in
+#define DLP(CALL, SENT, RECEIVED) ([&]() { \
+    auto dlpstart = std::chrono::steady_clock::now(); \
+    auto dlpresult = CALL; \
+    dlptrace.add(#CALL, SENT, RECEIVED, dlpresult, dlpstart); \
+    return dlpresult; }())
+
+class DLPTrace {
+    public:
+        // start tracing, optionally writing every call to filename as it happens
+        void start(std::string filename) {
+            enabled = true;
+            if (filename.length() > 0) {
+                file.open(filename);
+                if (!file) {
+                    std::cerr << "    ERROR unable to open DLP trace file " << filename << std::endl;
+                }
+                file << "# seconds, call, bytes sent, bytes received, microseconds, result" << std::endl;
+            }
+        }
+
+        void add(const char *call, size_t sent, size_t received, int result, std::chrono::steady_clock::time_point start) {
+            if (!enabled) {
+                return;
+            }
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+            // the name of the call is everything up to the (
+            std::string name(call, strcspn(call, "("));
+
+            std::lock_guard<std::mutex> lock(mutex);
+            Calls &calls = bycall[name];
+            calls.seconds.push_back(elapsed.count());
+            calls.sent += sent;
+            calls.received += received;
+
+            if (file.is_open()) {
+                std::chrono::duration<double> at = start - began;
+                file << at.count() << ", " << name << ", " << sent << ", " << received << ", "
+                    << (long)(elapsed.count() * 1e6) << ", " << result << std::endl;
+            }
+        }
+
+        // print out the number of calls, time taken, and latency percentiles for each call
+        void report() {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!enabled || bycall.size() == 0) {
+                return;
+            }
+
+            std::cout << "    ==> DLP trace <==" << std::endl;
+            std::cout << "    call                     count    total s   sent B   recv B   p50 ms   p95 ms   p99 ms" << std::endl;
+            for (auto &[name, calls] : bycall) {
+                std::sort(calls.seconds.begin(), calls.seconds.end());
+                double total = 0;
+                for (double s : calls.seconds) {
+                    total += s;
+                }
+                char line[256];
+                snprintf(line, sizeof(line), "    %-22s %7zu %10.3f %8zu %8zu %8.1f %8.1f %8.1f", name.c_str(),
+                    calls.seconds.size(), total, calls.sent, calls.received,
+                    percentile(calls.seconds, 50) * 1e3, percentile(calls.seconds, 95) * 1e3, percentile(calls.seconds, 99) * 1e3);
+                std::cout << line << std::endl;
+            }
+            std::cout << std::endl << std::flush;
+
+            bycall.clear(); // only report once
+            if (file.is_open()) {
+                file.close();
+            }
+        }
+
+    private:
+        struct Calls {
+            std::vector<double> seconds;
+            size_t sent = 0, received = 0;
+        };
+
+        bool enabled = false;
+        std::chrono::steady_clock::time_point began = std::chrono::steady_clock::now();
+        std::map<std::string, Calls> bycall;
+        std::ofstream file;
+        std::mutex mutex; // pi_close may be traced from the watchdog thread
+
+        // nearest rank percentile of sorted values
+        static double percentile(const std::vector<double> &sorted, int p) {
+            size_t rank = (p * sorted.size() + 99) / 100;
+            return sorted[rank > 0 ? rank - 1 : 0];
+        }
+};
+
+DLPTrace dlptrace;
@@ -0,0 +1,313 @@
+/*
+ *
+ * Copyright (C) 2023 guruthree
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// a quick scan over the raw ical text before libical gets it, to leave out events that can't be in
+// the sync window (which for a calendar with years of history can be most of them). only DTSTART,
+// RECURRENCE-ID, RRULE, RDATE, and UID are looked at, and anything unclear is kept, the full checks
+// still happen after parsing
+
+#include <climits>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// find the next newline, 32 or 16 bytes at a time where the CPU allows (build with -DNATIVE=ON for AVX2)
+const char* FindNewline(const char *p, const char *end) {
+#if defined(__AVX2__)
+    const __m256i newline32 = _mm256_set1_epi8('\n');
+    for (; p + 32 <= end; p += 32) {
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)p), newline32));
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i newline16 = _mm_set1_epi8('\n');
+    for (; p + 16 <= end; p += 16) {
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), newline16));
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; p < end; p++) {
+        if (*p == '\n') {
+            return p;
+        }
+    }
+    return end;
+}
+
+// property and component names are case insensitive, and a property name is followed by : or ;
+bool IsProperty(std::string_view line, std::string_view name) {
+    return line.length() > name.length() && strncasecmp(line.data(), name.data(), name.length()) == 0 &&
+        (line[name.length()] == ':' || line[name.length()] == ';');
+}
+
+bool IsLine(std::string_view line, std::string_view text) {
+    return line.length() == text.length() && strncasecmp(line.data(), text.data(), text.length()) == 0;
+}
+
+// the value of a property, after the first : that isn't inside a quoted parameter
+std::string_view PropertyValue(std::string_view line) {
+    bool quoted = false;
+    for (size_t i = 0; i < line.length(); i++) {
+        if (line[i] == '"') {
+            quoted = !quoted;
+        }
+        else if (line[i] == ':' && !quoted) {
+            return line.substr(i + 1);
+        }
+    }
+    return std::string_view();
+}
+
+#define NO_DAY LONG_MIN
+
+// days since 1970-01-01 from the YYYYMMDD at the start of an ical date or date-time, NO_DAY if it isn't one
+long DayOf(std::string_view value) {
+    if (value.length() < 8) {
+        return NO_DAY;
+    }
+    int digits[8];
+    for (int i = 0; i < 8; i++) {
+        if (value[i] < '0' || value[i] > '9') {
+            return NO_DAY;
+        }
+        digits[i] = value[i] - '0';
+    }
+    long y = digits[0] * 1000 + digits[1] * 100 + digits[2] * 10 + digits[3];
+    long m = digits[4] * 10 + digits[5], d = digits[6] * 10 + digits[7];
+
+    // days from civil, http://howardhinnant.github.io/date_algorithms.html
+    y -= m <= 2;
+    long era = (y >= 0 ? y : y - 399) / 400;
+    long yoe = y - era * 400;
+    long doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+// drop the VEVENTs from ics that can't be in the window from windowstart to windowend (0 for no end),
+// writing what's left (including everything outside of VEVENTs, e.g., VTIMEZONEs) to filtered
+// returns the number of events dropped, filtered is only written to if that's more than 0
+int FilterCalendar(std::string_view ics, time_t windowstart, time_t windowend, std::string &filtered) {
+
+    struct Block {
+        size_t begin = 0, end = 0; // from the start of the BEGIN:VEVENT line to after the END:VEVENT line
+        long start = NO_DAY, recurrenceid = NO_DAY, until = LONG_MAX;
+        bool repeats = false;
+        std::string uid;
+        bool keep = true;
+    };
+    std::vector<Block> blocks;
+
+    const char *data = ics.data(), *end = data + ics.length();
+    Block block;
+    bool inevent = false;
+    int depth = 0; // of components inside the VEVENT (e.g., VALARM), whose properties don't count
+
+    for (const char *p = data; p < end; ) {
+        const char *eol = FindNewline(p, end);
+        const char *next = eol < end ? eol + 1 : end;
+        std::string_view line(p, eol - p);
+        if (line.length() > 0 && line.back() == '\r') {
+            line.remove_suffix(1);
+        }
+
+        if (!inevent) {
+            if (IsLine(line, "BEGIN:VEVENT")) {
+                block = Block();
+                block.begin = p - data;
+                inevent = true;
+                depth = 0;
+            }
+        }
+        else if (IsLine(line, "END:VEVENT")) {
+            block.end = next - data;
+            blocks.push_back(std::move(block));
+            inevent = false;
+        }
+        else if (line.length() >= 6 && strncasecmp(line.data(), "BEGIN:", 6) == 0) {
+            depth++;
+        }
+        else if (line.length() >= 4 && strncasecmp(line.data(), "END:", 4) == 0) {
+            depth--;
+        }
+        else if (depth == 0 && line.length() > 0 && line[0] != ' ' && line[0] != '\t') {
+            bool uid = IsProperty(line, "UID"), rrule = IsProperty(line, "RRULE");
+            if (uid || rrule) {
+                // these can be long enough to be folded onto the following lines
+                std::string value(PropertyValue(line));
+                while (next < end && (*next == ' ' || *next == '\t')) {
+                    const char *foldeol = FindNewline(next, end);
+                    std::string_view fold(next + 1, foldeol - next - 1);
+                    if (fold.length() > 0 && fold.back() == '\r') {
+                        fold.remove_suffix(1);
+                    }
+                    value += fold;
+                    next = foldeol < end ? foldeol + 1 : end;
+                }
+                if (uid) {
+                    block.uid = value;
+                }
+                else {
+                    block.repeats = true;
+                    for (size_t at = 0; at + 6 < value.length(); at++) {
+                        if (strncasecmp(value.data() + at, "UNTIL=", 6) == 0) {
+                            long until = DayOf(std::string_view(value).substr(at + 6));
+                            block.until = until != NO_DAY ? until : LONG_MAX;
+                            break;
+                        }
+                    }
+                }
+            }
+            else if (IsProperty(line, "DTSTART")) {
+                block.start = DayOf(PropertyValue(line));
+            }
+            else if (IsProperty(line, "RECURRENCE-ID")) {
+                block.recurrenceid = DayOf(PropertyValue(line));
+            }
+            else if (IsProperty(line, "RDATE")) {
+                block.repeats = true; // extra dates could be anywhere, keep it
+                block.until = LONG_MAX;
+            }
+        }
+
+        p = next;
+    }
+
+    // a couple of days either side, as the window's set in UTC and event times may be in any timezone
+    long first = windowstart / 86400 - 2, last = windowend > 0 ? windowend / 86400 + 2 : LONG_MAX;
+    auto inwindow = [first, last](long day) { return day != NO_DAY && day >= first && day <= last; };
+
+    int dropped = 0;
+    std::unordered_set<std::string> kept; // UIDs, as events with the same UID get merged together
+    for (Block &b : blocks) {
+        if (b.start == NO_DAY) {
+            b.keep = true; // not sure, let libical work it out
+        }
+        else if (b.repeats && b.until != LONG_MAX) {
+            b.keep = b.start <= last && b.until >= first;
+        }
+        else if (b.repeats) {
+            b.keep = b.start <= last;
+        }
+        else {
+            b.keep = inwindow(b.start) || inwindow(b.recurrenceid);
+        }
+        if (b.keep && b.uid.length() > 0) {
+            kept.insert(b.uid);
+        }
+    }
+    for (Block &b : blocks) {
+        if (!b.keep && b.uid.length() > 0 && kept.count(b.uid) > 0) {
+            b.keep = true;
+        }
+        dropped += !b.keep;
+    }
+    if (dropped == 0) {
+        return 0;
+    }
+
+    // copy everything but the events being left out
+    filtered.clear();
+    filtered.reserve(ics.length());
+    size_t at = 0;
+    for (Block &b : blocks) {
+        if (!b.keep) {
+            filtered.append(data + at, b.begin - at);
+            at = b.end;
+        }
+    }
+    filtered.append(data + at, ics.length() - at);
+
+    return dropped;
+}
+
+// count how many times each VEVENT's UID appears in ics, adding to counts (events with the same UID
+// get merged together, so one whose UID appears just once in all of the calendars is done with as
+// soon as it's converted). the UID is unfolded and unescaped as libical would
+void CountUIDs(std::string_view ics, std::unordered_map<std::string, int> &counts) {
+    const char *data = ics.data(), *end = data + ics.length();
+    bool inevent = false;
+    int depth = 0;
+
+    for (const char *p = data; p < end; ) {
+        const char *eol = FindNewline(p, end);
+        const char *next = eol < end ? eol + 1 : end;
+        std::string_view line(p, eol - p);
+        if (line.length() > 0 && line.back() == '\r') {
+            line.remove_suffix(1);
+        }
+
+        if (!inevent) {
+            if (IsLine(line, "BEGIN:VEVENT")) {
+                inevent = true;
+                depth = 0;
+            }
+        }
+        else if (IsLine(line, "END:VEVENT")) {
+            inevent = false;
+        }
+        else if (line.length() >= 6 && strncasecmp(line.data(), "BEGIN:", 6) == 0) {
+            depth++;
+        }
+        else if (line.length() >= 4 && strncasecmp(line.data(), "END:", 4) == 0) {
+            depth--;
+        }
+        else if (depth == 0 && IsProperty(line, "UID")) {
+            std::string value(PropertyValue(line));
+            while (next < end && (*next == ' ' || *next == '\t')) {
+                const char *foldeol = FindNewline(next, end);
+                std::string_view fold(next + 1, foldeol - next - 1);
+                if (fold.length() > 0 && fold.back() == '\r') {
+                    fold.remove_suffix(1);
+                }
+                value += fold;
+                next = foldeol < end ? foldeol + 1 : end;
+            }
+
+            // \\, \;, \, and \n are escapes in text values
+            std::string uid;
+            for (size_t i = 0; i < value.length(); i++) {
+                if (value[i] == '\\' && i + 1 < value.length()) {
+                    i++;
+                    uid += value[i] == 'n' || value[i] == 'N' ? '\n' : value[i];
+                }
+                else {
+                    uid += value[i];
+                }
+            }
+            counts[uid]++;
+        }
+
+        p = next;
+    }
+}
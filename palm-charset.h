@@ -0,0 +1,135 @@
+/*
+ *
+ * Copyright (C) 2023 guruthree
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// ical text is UTF-8, but the palm shows text in its own character set (Palm Latin, which is windows-1252
+// for everything that matters), so accented letters need converting to their single byte there and
+// anything the palm can't show (e.g., emoji) replacing. most calendar text is plain ASCII, which is the
+// same in both, so that's skipped over 16 or 32 bytes at a time
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// the windows-1252 characters from 0x80 to 0x9f, which aren't the same as unicode (0xa0 to 0xff are),
+// along with a few common characters it doesn't have but that have a close enough equivalent
+// sorted by code point to be searched
+const struct {
+    uint32_t codepoint;
+    unsigned char palm;
+} PalmCharacters[] = {
+    {0x0152, 0x8c}, {0x0153, 0x9c}, {0x0160, 0x8a}, {0x0161, 0x9a}, {0x0178, 0x9f}, {0x017d, 0x8e}, {0x017e, 0x9e},
+    {0x0192, 0x83}, {0x02c6, 0x88}, {0x02dc, 0x98}, {0x2010, '-'}, {0x2011, '-'}, {0x2012, 0x96}, {0x2013, 0x96},
+    {0x2014, 0x97}, {0x2018, 0x91}, {0x2019, 0x92}, {0x201a, 0x82}, {0x201c, 0x93}, {0x201d, 0x94}, {0x201e, 0x84},
+    {0x2020, 0x86}, {0x2021, 0x87}, {0x2022, 0x95}, {0x2026, 0x85}, {0x2030, 0x89}, {0x2039, 0x8b}, {0x203a, 0x9b},
+    {0x20ac, 0x80}, {0x2122, 0x99}, {0x2212, '-'},
+};
+
+// the palm's character for a code point, 0 if it doesn't have one
+unsigned char PalmCharacter(uint32_t codepoint) {
+    if (codepoint < 0x80 || (codepoint >= 0xa0 && codepoint <= 0xff)) {
+        return codepoint;
+    }
+    auto found = std::lower_bound(std::begin(PalmCharacters), std::end(PalmCharacters), codepoint,
+        [](const auto &character, uint32_t codepoint) { return character.codepoint < codepoint; });
+    return found != std::end(PalmCharacters) && found->codepoint == codepoint ? found->palm : 0;
+}
+
+// how many bytes from p (up to end) are ASCII, at least 16 or 32 at a time where the CPU allows
+size_t AsciiLength(const char *p, const char *end) {
+    const char *start = p;
+#if defined(__AVX2__)
+    for (; p + 32 <= end; p += 32) {
+        if (_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i*)p)) != 0) {
+            break;
+        }
+    }
+#endif
+#if defined(__SSE2__)
+    for (; p + 16 <= end; p += 16) {
+        if (_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)p)) != 0) {
+            break;
+        }
+    }
+#endif
+    for (; p < end && (unsigned char)*p < 0x80; p++);
+    return p - start;
+}
+
+// convert UTF-8 text to the palm's character set in place (it only ever gets shorter), characters the
+// palm doesn't have and bytes that aren't valid UTF-8 become replacement (or are left out if it's 0)
+// returns how many characters were replaced
+int TranscodeForPalm(char *text, char replacement) {
+    if (text == nullptr) {
+        return 0;
+    }
+
+    int replaced = 0;
+    size_t length = strlen(text);
+    const char *in = text, *end = text + length;
+    char *out = text;
+    while (in < end) {
+
+        // plain ASCII is copied across as it is (and not even that until something's been shortened)
+        size_t ascii = AsciiLength(in, end);
+        if (out != in) {
+            memmove(out, in, ascii);
+        }
+        in += ascii;
+        out += ascii;
+        if (in == end) {
+            break;
+        }
+
+        // decode one UTF-8 sequence
+        unsigned char lead = *in;
+        int extra = lead >= 0xc2 && lead <= 0xdf ? 1 : lead >= 0xe0 && lead <= 0xef ? 2 : lead >= 0xf0 && lead <= 0xf4 ? 3 : -1;
+        uint32_t codepoint = extra == 1 ? lead & 0x1f : extra == 2 ? lead & 0x0f : lead & 0x07;
+        int used = 1;
+        for (; extra > 0 && used <= extra && in + used < end && ((unsigned char)in[used] & 0xc0) == 0x80; used++) {
+            codepoint = (codepoint << 6) | (in[used] & 0x3f);
+        }
+        bool valid = extra > 0 && used == extra + 1 &&
+            // overlong and surrogate encodings aren't valid either
+            !(extra == 2 && (codepoint < 0x800 || (codepoint >= 0xd800 && codepoint <= 0xdfff))) &&
+            !(extra == 3 && (codepoint < 0x10000 || codepoint > 0x10ffff));
+        in += valid ? extra + 1 : 1;
+
+        unsigned char palm = valid ? PalmCharacter(codepoint) : 0;
+        if (palm == 0) {
+            // a zero width joiner, variation selector, or skin tone (as in a lot of emoji) doesn't need its own replacement
+            if (valid && (codepoint == 0x200d || (codepoint >= 0xfe00 && codepoint <= 0xfe0f) ||
+                    (codepoint >= 0x1f3fb && codepoint <= 0x1f3ff))) {
+                continue;
+            }
+            replaced++;
+            palm = replacement;
+        }
+        if (palm != 0) {
+            *out++ = palm;
+        }
+    }
+    *out = '\0';
+
+    return replaced;
+}
@@ -0,0 +1,197 @@
+/*
+ *
+ * Copyright (C) 2023 guruthree
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// working out the date of the last occurrence of a repeating event from its COUNT, as the palm only
+// knows about end dates. this is done directly from the repeat pattern rather than stepping through
+// each occurrence, so a COUNT of a million costs the same as a COUNT of one, and it's all done in
+// days so there's no normalising through timegm along the way
+
+#include <ctime>
+#include <numeric>
+
+#include <libpisock/pi-datebook.h>
+
+// the palm stores years as 7 bits from 1904
+#define PALM_LAST_YEAR 2031
+
+// days since 1970-01-01 of a date (month 1 to 12), http://howardhinnant.github.io/date_algorithms.html
+long DaysFromCivil(long y, long m, long d) {
+    y -= m <= 2;
+    long era = (y >= 0 ? y : y - 399) / 400;
+    long yoe = y - era * 400;
+    long doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+// and back again
+void CivilFromDays(long z, long &y, long &m, long &d) {
+    z += 719468;
+    long era = (z >= 0 ? z : z - 146096) / 146097;
+    long doe = z - era * 146097;
+    long yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    long doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    long mp = (5 * doy + 2) / 153;
+    d = doy - (153 * mp + 2) / 5 + 1;
+    m = mp < 10 ? mp + 3 : mp - 9;
+    y = yoe + era * 400 + (m <= 2);
+}
+
+bool IsLeapYear(long y) {
+    return y % 4 == 0 && (y % 100 != 0 || y % 400 == 0);
+}
+
+int DaysInMonth(long y, long m) {
+    static const int days[12] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    return m == 2 && IsLeapYear(y) ? 29 : days[m - 1];
+}
+
+// 0 to 6 Sunday to Saturday, 1970-01-01 was a Thursday
+int WeekdayOfDays(long z) {
+    return (int)(((z % 7) + 11) % 7);
+}
+
+// the step (from 0) of the count-th (from 1) step that's valid, where which steps are valid repeats
+// every period steps, e.g., every 12 months for the 31st of the month happening in 7 of them
+// returns -1 if no step is ever valid
+template <typename F>
+long NthValidStep(long count, long period, F valid) {
+    long perperiod = 0;
+    for (long k = 0; k < period; k++) {
+        perperiod += valid(k);
+    }
+    if (perperiod == 0) {
+        return -1;
+    }
+    long periods = (count - 1) / perperiod, remaining = (count - 1) % perperiod + 1;
+    for (long k = 0; ; k++) {
+        if (valid(k) && --remaining == 0) {
+            return periods * period + k;
+        }
+    }
+}
+
+// set last to the last moment of the day of the count-th occurrence (from 1, the start being the first)
+// of the appointment's repeat pattern, the way the palm repeats it
+// returns false if that's after the palm's calendar ends (or never happens), so it might as well repeat forever
+bool LastOccurrence(const Appointment &appointment, long count, tm &last) {
+
+    long y = appointment.begin.tm_year + 1900, m = appointment.begin.tm_mon + 1, d = appointment.begin.tm_mday;
+    long start = DaysFromCivil(y, m, d), palmend = DaysFromCivil(PALM_LAST_YEAR, 12, 31);
+    long interval = appointment.repeatFrequency < 1 ? 1 : appointment.repeatFrequency;
+
+    // every pattern takes at least a day between occurrences, which keeps everything below well inside a long
+    if (count < 1 || count - 1 > palmend - start) {
+        return false;
+    }
+
+    long z = start; // the day of the last occurrence
+    if (appointment.repeatType == repeatDaily) {
+        z = start + (count - 1) * interval;
+    }
+    else if (appointment.repeatType == repeatWeekly) {
+
+        // the repeat days in the order they come in the week
+        int weekstart = appointment.repeatWeekstart, days[7], numdays = 0;
+        for (int i = 0; i < 7; i++) {
+            if (appointment.repeatDays[(weekstart + i) % 7]) {
+                days[numdays++] = i;
+            }
+        }
+        if (numdays == 0) {
+            return false;
+        }
+
+        // the first week may be partway through, only days from the start on count
+        int offset = (WeekdayOfDays(start) - weekstart + 7) % 7, firstweek = 0;
+        while (firstweek < numdays && days[numdays - 1 - firstweek] >= offset) {
+            firstweek++;
+        }
+        long week = start - offset; // the day the start's week begins
+
+        if (count <= firstweek) {
+            z = week + days[numdays - firstweek + count - 1];
+        }
+        else {
+            long remaining = count - firstweek - 1;
+            z = week + (remaining / numdays + 1) * interval * 7 + days[remaining % numdays];
+        }
+    }
+    else if (appointment.repeatType == repeatMonthlyByDate || appointment.repeatType == repeatMonthlyByDay) {
+
+        // months counted from year 0, every month is valid unless it's missing the day (e.g., the 31st)
+        long month = y * 12 + m - 1, step = count - 1;
+        if (appointment.repeatType == repeatMonthlyByDate && d > 28) {
+            // the calendar repeats every 400 years, so the months with the day do too
+            step = NthValidStep(count, 4800 / std::gcd(interval, 4800L), [&](long k) {
+                long at = month + k * interval;
+                return d <= DaysInMonth(at / 12, at % 12 + 1);
+            });
+        }
+        month += step * interval;
+        if (step < 0 || month / 12 > PALM_LAST_YEAR) {
+            return false;
+        }
+        long atyear = month / 12, atmonth = month % 12 + 1;
+
+        if (appointment.repeatType == repeatMonthlyByDate) {
+            z = DaysFromCivil(atyear, atmonth, d);
+        }
+        else {
+            // the nth weekday of the month, or the last one
+            int week = appointment.repeatDay / 7, weekday = appointment.repeatDay % 7;
+            if (week < 4) {
+                long first = DaysFromCivil(atyear, atmonth, 1);
+                z = first + (weekday - WeekdayOfDays(first) + 7) % 7 + week * 7;
+            }
+            else {
+                long end = DaysFromCivil(atyear, atmonth, DaysInMonth(atyear, atmonth));
+                z = end - (WeekdayOfDays(end) - weekday + 7) % 7;
+            }
+        }
+    }
+    else if (appointment.repeatType == repeatYearly) {
+        long step = count - 1;
+        if (m == 2 && d == 29) {
+            // only leap years, which repeat every 400 years
+            step = NthValidStep(count, 400 / std::gcd(interval, 400L), [&](long k) { return IsLeapYear(y + k * interval); });
+        }
+        if (step < 0 || y + step * interval > PALM_LAST_YEAR) {
+            return false;
+        }
+        z = DaysFromCivil(y + step * interval, m, d);
+    }
+
+    if (z > palmend) {
+        return false;
+    }
+
+    CivilFromDays(z, y, m, d);
+    last = appointment.begin;
+    last.tm_year = y - 1900;
+    last.tm_mon = m - 1;
+    last.tm_mday = d;
+    last.tm_wday = WeekdayOfDays(z);
+    last.tm_yday = z - DaysFromCivil(y, 1, 1);
+    last.tm_hour = 23; // palm os ends on the day specified
+    last.tm_min = 59;
+    last.tm_sec = 59;
+    return true;
+}
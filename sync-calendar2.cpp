@@ -22,10 +22,12 @@
 // if we're really good also try to not repeat any event that already exists
 // note not fully ical complient, but should work with google calendar exports
 
+#include <algorithm>
 #include <cstring>
 #include <filesystem>
 #include <iostream>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include <libconfig.h++>
@@ -39,6 +41,11 @@
 #include <libpisock/pi-usb.h>
 
 #include "libusb.h"
+#include "dlp-trace.h"
+#include "alloc-trace.h"
+#include "ical-scan.h"
+#include "recur-count.h"
+#include "palm-charset.h"
 #include "sync-calendar2.h"
 
 // add log4cplus for logging?
@@ -54,19 +61,478 @@ void helpmessage() {
     std::cout << "        -c  Specify config file (default " << DEFAULT_CONFIG_FILE << ")" << std::endl;
     std::cout << "        -h  Print this help message and quit" << std::endl;
     std::cout << "        -p  Override config file port (e.g., /dev/ttyS0, net:any, usb:)" << std::endl;
-    std::cout << "        -u  Override calendar URI (can be used multiple times)" << std::endl;
+    std::cout << "        -P  Prepare a Palm user's profile ahead of their HotSync, without connecting to the Palm" << std::endl;
+    std::cout << "        -s  Override config file serial rate (e.g., 115200, or auto to find the fastest)" << std::endl;
+    std::cout << "        -u  Override calendar URI (can be used multiple times, - for stdin)" << std::endl;
     std::cout << std::endl;
 }
 
+// convert a VEVENT to a pilot-link Appointment, apart from fitting it to the sync window (see ConvertEvent)
+// nothing here may depend on today's date, as the result is kept in the conversion cache
+ConvertedEvent ConvertEventFields(icalcomponent *c, const ConvertOptions &options) {
+
+    // palm only has start time, end time, alarm, repeat, description, and note
+    // so we only need to extract those things from the component if they're there
+    // every event should have a DTSTART, DTEND, and DTSUMMARY (which is palm description)
+    // palm won't take an event with a description
+
+    ConvertedEvent converted;
+    std::ostringstream log;
+    bool &failed = converted.failed;
+
+    log << "    ==> Processing event <==" << std::endl;
+
+    /* find out if this is part of an existing Appointment */
+
+    // use event UID to detect duplicates & merge (Google seems to split things out sometimes?)
+    // this happens later when the events are merged together in order, what's needed is worked out here
+    icalproperty *uidp = icalcomponent_get_first_property(c, ICAL_UID_PROPERTY);
+
+    bool isarecurrence = converted.isarecurrence = icalcomponent_count_properties(c, ICAL_RECURRENCEID_PROPERTY) > 0;
+
+    std::string &uid = converted.uid;
+    if (uidp != nullptr) {
+        uid = icalproperty_get_uid(uidp);
+        if (!isarecurrence) {
+            log << "    UID: " << uid << std::endl;
+        }
+        else {
+            log << "    Recurrence of UID: " << uid << std::endl;
+
+            // which of the parent's repeats this replaces
+            icaltimetype recurrenceid = icalcomponent_get_recurrenceid(c);
+            converted.recurrenceid = icaltime_as_timet_with_zone(recurrenceid, icaltime_get_timezone(recurrenceid));
+        }
+    }
+
+    // store information about this event in the pilot-link Appointment struct
+    // see pi-datebook.h for details of format
+    // if this uid exists twice, the later one in the file is assumed to be newer and overwrites any
+    // properties it specifies, so keep track of which were specified
+    Appointment &appointment = converted.appointment;
+
+
+    /* date time description essentials */
+
+    // convert dates and times to tm for transfer to palm
+    icaltimetype start = icalcomponent_get_dtstart(c);
+    time_t start_time_t = icaltime_as_timet_with_zone(start, icaltime_get_timezone(start));
+    appointment.begin = UTCTime(start_time_t);
+    log << "    Start UTC: " << AscTime(appointment.begin);
+
+    icaltimetype end = icalcomponent_get_dtend(c);
+    time_t end_time_t = icaltime_as_timet_with_zone(end, icaltime_get_timezone(end));
+    appointment.end = UTCTime(end_time_t);
+    log << "    End UTC: " << AscTime(appointment.end);
+
+    // if it's just a date in ical the appointment is an all day event
+    if (icaltime_is_date(start) && icaltime_is_date(end))
+        appointment.event          = 1;
+    else
+        appointment.event          = 0;
+
+    // libical's strings are looked at in place through string_views and only copied once,
+    // straight into the char* that will be packed for the palm
+
+    // get the summary and description / note
+    std::string_view summary = ViewOf(icalcomponent_get_summary(c));
+    std::string_view description = ViewOf(icalcomponent_get_description(c));
+
+    // if there's no summary and a 1 line description, use the description as a summary instead
+    // (mostly for the ical recur checks really)
+    if (summary.length() == 0 && description.length() > 0 && description.find('\n') == std::string_view::npos) {
+        summary = description;
+        description = std::string_view();
+    }
+
+    if (summary.length() > 0) {
+        log << "    Summary: " << summary << std::endl;
+        appointment.description        = CopyOf(summary);
+        converted.hasdescription = true;
+        if (options.transcode && TranscodeForPalm(appointment.description, options.unmappable) > 0) {
+            log << "        Replaced characters the palm doesn't have" << std::endl;
+        }
+    }
+    else {
+        appointment.description        = nullptr;
+    }
+
+    // get the location (palmos5 has a location but pilot-link doesn't support it - different database format?)
+    std::string_view location = ViewOf(icalcomponent_get_location(c));
+
+    // add attendees list to the note, by their CN (common name) or otherwise e-mail address
+    std::vector<std::string_view> attendees;
+    int numattendees = icalcomponent_count_properties(c, ICAL_ATTENDEE_PROPERTY);
+    if (numattendees > 0) {
+        
+        log << "    " << numattendees << " attendees" << std::endl;
+
+        attendees.reserve(numattendees);
+        for(icalproperty *attendeep = icalcomponent_get_first_property(c, ICAL_ATTENDEE_PROPERTY); attendeep != 0;
+                attendeep = icalcomponent_get_next_property(c, ICAL_ATTENDEE_PROPERTY)) {
+            attendees.push_back(AttendeeName(attendeep));
+        }
+
+    } // numattendees
+
+    // merge location, attendees, and description into the note
+    char *note = options.skipnotes ? nullptr : BuildNote(location, attendees, description);
+    if (note != nullptr) { // note might be empty
+
+        log << "    Note:\n" << note << std::endl;
+        appointment.note               = note;
+        converted.hasnote = true;
+        if (options.transcode) {
+            TranscodeForPalm(appointment.note, options.unmappable);
+        }
+    }
+    else {
+        appointment.note               = nullptr;
+    }
+
+
+    /* what about an alarm */
+
+    // palm os only supports one alarm, so find the nearest one and add that
+    appointment.alarm              = 0;
+    // we can't store the alarm if it's not enabled so just dummy values here
+    appointment.advance            = 0;
+    appointment.advanceUnits       = advMinutes;
+
+    int shortest_alarm = 9999989; // default value to c.f. if an alarm has been set
+    int numalarms = icalcomponent_count_components(c, ICAL_VALARM_COMPONENT);
+    if (numalarms > 0 && options.doalarms) {
+
+        // a VALARM is a sub-sub-component
+        icalcomponent *c2;
+
+        for(c2 = icalcomponent_get_first_component(c, ICAL_VALARM_COMPONENT); c2 != 0;
+                c2 = icalcomponent_get_next_component(c, ICAL_VALARM_COMPONENT)) {
+
+            // this is ignoring absolute alarms with TRIGGER;VALUE=DATE-TIME
+            // also assuming there's only ever one TRIGGER property
+            icaltriggertype trigger = \
+                icalproperty_get_trigger(icalcomponent_get_first_property(c2, ICAL_TRIGGER_PROPERTY));
+
+            if (trigger.duration.is_neg == 1) { // alarms only occur beforehand
+
+                // how far in advance is the alarm? we only work in minutes
+                int advance = (trigger.duration.weeks * 7 * 86400 + \
+                               trigger.duration.days * 86400 + \
+                               trigger.duration.hours * 3600 + \
+                               trigger.duration.minutes * 60 + 
+                               trigger.duration.seconds) / 60;
+                if (advance < shortest_alarm) {
+                    shortest_alarm = advance;
+                }
+            }
+        } // c2
+
+        if (shortest_alarm != 9999989) {
+            log << "    Alarm: " << shortest_alarm << " minutes before" << std::endl;
+            appointment.alarm              = 1;
+            appointment.advance            = shortest_alarm;
+            appointment.advanceUnits       = advMinutes;
+            converted.hasalarm = true;
+        }
+
+    } // numalarms
+
+
+    /* repat stuff, repeat stuff */
+
+    // RRULE repeating sets
+    // EXDATE dates in the set skipped, stored as a tm struct with year/month/day only
+    // RDATE one off of repeating events that were moved, they appear as a normal event so ignore?
+    // RECURRENCE-ID similar except they have the same UID so shouldn't be merged
+
+    // https://libical.github.io/libical/apidocs/icalrecur_8h.html
+    // https://libical.github.io/libical/apidocs/structicalrecurrencetype.html
+    // https://freetools.textmagic.com/rrule-generator
+    // https://icalendar.org/validator.html
+    // https://icalendar.org/iCalendar-RFC-5545/3-3-10-recurrence-rule.html
+
+    // ical to pilot-link mapping
+    // X INTERVAL => repeatFrequency
+    // X UNTIL => repeatEnd, repeatForever
+    // X COUNT => repeatEnd
+    // X WKST => repeatWeekstart
+    // X BYMONTHDAY => repeatMonthlyByDay
+    // X BYDAY => repeatDays
+    // X FREQ => repeatType, repeatDay (montly), repeatDays (weekly)
+    // X EXDATE => exception, exceptions
+
+    // for final repetition checks, need to test COUNT, EXDATE, RECURRENCE-ID thoroughly
+    //     for each daily, weekly, monthly, yearly
+    //     repeat forever, repeat until, repeat count
+    //     exclude or move three
+    // can also check against recur.txt from libical test-data
+
+    // declare some saine defaults to start with
+    appointment.repeatType         = repeatNone;
+    appointment.repeatForever      = 0;
+    appointment.repeatEnd.tm_year  = 0;
+    appointment.repeatEnd.tm_mon   = 0;
+    appointment.repeatEnd.tm_mday  = 0;
+    appointment.repeatEnd.tm_wday  = 0;
+    appointment.repeatFrequency    = 0;
+    appointment.repeatWeekstart    = 1; // 0-6 Sunday to Saturday, ical default is Monday so 1
+    for (int i = 0; i < 7; i++) appointment.repeatDays[i] = 0;
+//    appointment.repeatDay          = 0;
+    appointment.exceptions         = 0;
+    appointment.exception          = nullptr; // this is an array, yikes
+
+    // this assumes there's only ever one RRULE property (palm can only support one anyway)
+    icalproperty *rrule = icalcomponent_get_first_property(c, ICAL_RRULE_PROPERTY);
+    if (rrule != nullptr) {
+
+        converted.hasrrule = true;
+        icalrecurrencetype recur = icalproperty_get_rrule(rrule);
+        log << "    Recurrence: " << icalrecurrencetype_as_string(&recur) << std::endl;
+
+        // we're assuming UNTIL and COUNT are mutually exclusive
+        if (recur.until.year != 0) {
+
+            // there's an until date, use that
+            time_t until_time_t = icaltime_as_timet_with_zone(recur.until, icaltime_get_timezone(recur.until));
+            appointment.repeatEnd = UTCTime(until_time_t);
+            appointment.repeatEnd.tm_hour = 23; // as below
+            appointment.repeatEnd.tm_min = 59;
+            appointment.repeatEnd.tm_sec = 59;
+        }
+        else if (recur.count == 0) {
+
+            // no until date, for the moment assume repeating forever
+            appointment.repeatForever = 1;
+        }
+        // otherwise there's a COUNT, which is turned into an end date once the repeat pattern is known below
+
+        appointment.repeatFrequency = recur.interval < 1 ? 1 : recur.interval; // 1 or INTERVAL
+
+        // palm looks a bit different than libical here with the 1 being monday as opposed to 2 (ICAL_MONDAY_WEEKDAY)
+        appointment.repeatWeekstart = weekday2int(recur.week_start);
+
+        // palm doesn't support anything less than daily
+        UNSUPPORTED_ICAL(by_second, BYSECOND)
+        UNSUPPORTED_ICAL(by_minute, BYMINUTE)
+        UNSUPPORTED_ICAL(by_hour, BYHOUR)
+        // e.g., the first of Monday and Wednesday each week, which would otherwise become both
+        UNSUPPORTED_ICAL(by_set_pos, BYSETPOS)
+
+        icalrecurrencetype_frequency freq = recur.freq;
+        if (freq == ICAL_NO_RECURRENCE || 
+                freq == ICAL_SECONDLY_RECURRENCE || 
+                freq == ICAL_MINUTELY_RECURRENCE || 
+                freq == ICAL_HOURLY_RECURRENCE) {
+
+            // palm doesn't support anything less than daily, so no repeating
+            appointment.repeatType = repeatNone;
+            failed = true;
+            log << "        WARNING unsupported frequency, won't copy!" << std::endl;
+        }
+        else if (freq == ICAL_DAILY_RECURRENCE) {
+
+            log << "    Repeating daily" << std::endl;
+            appointment.repeatType = repeatDaily;
+
+            UNSUPPORTED_ICAL(by_month, BYMONTH)
+        }
+        else if (freq == ICAL_WEEKLY_RECURRENCE) {
+
+            log << "    Repeating weekly" << std::endl;
+            appointment.repeatType = repeatWeekly; // repeatDays from BYDAY
+
+            // need to loop as there might be more than one day..?
+            for (int i = 0; recur.by_day[i] != ICAL_RECURRENCE_ARRAY_MAX; i++) {
+                int day = weekday2int(icalrecurrencetype_day_day_of_week(recur.by_day[i]));
+                appointment.repeatDays[day] = 1;
+                log << "        Repeating day " << day << std::endl;
+            }
+
+            // check to make sure some repeat days are selected, if not, repeat on all days
+            int numrepeatdays = 0;
+            for (int i = 0; i < 7; i++) {
+                numrepeatdays += appointment.repeatDays[i];
+            }
+            if (numrepeatdays == 0) {
+                log << "        Repeating all days (assumed)" << std::endl;
+                for (int i = 0; i < 7; i++) {
+                    appointment.repeatDays[i] = 1;
+                }
+//                            recur.count = recur.count * 7; // recur.count is otherwise days?
+            }
+        }
+        else if (freq == ICAL_MONTHLY_RECURRENCE) {
+
+            log << "    Repeating montly" << std::endl;
+            // events usually only repeat on one day of the month, so just check the 0th index
+            if (recur.by_month_day[0] != ICAL_RECURRENCE_ARRAY_MAX) { // BYMONTHDAY
+
+                // nothing extra to set, palm will just assume it's the date of the start
+                appointment.repeatType = repeatMonthlyByDate;
+                // day of the month in by day repeat - this is done in pilot-datebook, but doesn't seem needed based on pi-datebook.h
+                appointment.repeatDay = (DayOfMonthType)recur.by_month_day[0]; 
+                log << "        Repeating on " << appointment.begin.tm_mday << std::endl;
+
+                UNSUPPORTED_ICAL1(by_month_day, BYMONTHDAY)
+            }
+            else { // BYDAY   
+   
+                // should only ever be the first day as monthly things can't occur more than once a month
+                if (recur.by_day[0] != ICAL_RECURRENCE_ARRAY_MAX) {
+                    int week = icalrecurrencetype_day_position(recur.by_day[0]);
+                    if (week <= 0) {
+                        // all days of the month (0) or counting backwards from end of month
+                        // can't use macro here because some BYDAY are supported
+                        failed = true;
+                        log << "        WARNING unsupported BYDAY, won't copy!" << std::endl;
+                    }
+                    else {
+                        int day = weekday2int(icalrecurrencetype_day_day_of_week(recur.by_day[0]));
+
+                        // not ideal, but I don't expect the DayOfMonthType enum to change anytime soon
+                        appointment.repeatDay = (DayOfMonthType)((week - 1)*7 + day);
+
+                        log << "        Repeating the " << day << " of week " << week <<
+                            " (enum " << appointment.repeatDay << " " << DayOfMonthString[appointment.repeatDay] << ")" << std::endl;
+
+                        appointment.repeatType = repeatMonthlyByDay;
+                    }
+                }
+                else {
+                    log << "        WARNING unexpected repeat???" << std::endl;
+                }
+            }
+        }
+        else if (freq == ICAL_YEARLY_RECURRENCE) {
+            log << "    Repeating yearly" << std::endl;
+            appointment.repeatType = repeatYearly;
+
+            UNSUPPORTED_ICAL(by_day, BYDAY)
+            UNSUPPORTED_ICAL(by_month, BYMONTH)
+            UNSUPPORTED_ICAL(by_year_day, BYYEARDAY)  
+            UNSUPPORTED_ICAL(by_week_no, BYWEEKNO)                    
+        }
+        else {
+            log << "    Unknown repeat frequency" << std::endl;
+        }
+
+        // convert repeat count to repeat end date, the day of the last occurrence (palm os ends on the day specified)
+        if (recur.until.year == 0 && recur.count != 0 && appointment.repeatType != repeatNone) {
+            if (!LastOccurrence(appointment, recur.count, appointment.repeatEnd)) {
+                log << "        Repeats past the end of the palm's calendar, repeating forever" << std::endl;
+                appointment.repeatForever = 1;
+            }
+        }
+        if (!appointment.repeatForever) {
+            log << "        Until " << AscTime(appointment.repeatEnd);
+        }
+
+
+        /* argh exceptions */
+
+        appointment.exceptions = icalcomponent_count_properties(c, ICAL_EXDATE_PROPERTY);
+        if (appointment.exceptions != 0) {
+            log << "    There are " << appointment.exceptions << " exceptions" << std::endl;
+        }
+
+        appointment.exception = (tm*)malloc(appointment.exceptions * sizeof(tm)); // this should be freed by free_Appointment later
+
+        int exceptionat = 0;
+        for(icalproperty *exdatep = icalcomponent_get_first_property(c, ICAL_EXDATE_PROPERTY); exdatep != 0;
+                exdatep = icalcomponent_get_next_property(c, ICAL_EXDATE_PROPERTY), exceptionat++) {
+
+            icaltimetype exdate = icalproperty_get_exdate(exdatep);
+            time_t exdate_time_t = icaltime_as_timet_with_zone(exdate, icaltime_get_timezone(exdate));
+
+            appointment.exception[exceptionat] = UTCTime(exdate_time_t);
+            log << "        Excluding " << AscTime(appointment.exception[exceptionat]);
+        } // for exdatep
+    } // rrule
+
+    converted.log = log.str();
+    return converted;
+}
+
+// convert a VEVENT to a pilot-link Appointment, without reference to any other events
+// (so that events can be converted on several threads at once and merged afterwards)
+// events already in the conversion cache only need fitting to the sync window
+ConvertedEvent ConvertEvent(icalcomponent *c, const ConvertOptions &options, const ConversionCache &cache) {
+
+    ConvertedEvent converted;
+
+    // events the FILTERS rules leave out only need enough to know which other events they affect
+    const char *filteredby = options.filters.size() > 0 ? FilterEvent(c, options.filters) : nullptr;
+    if (filteredby != nullptr) {
+        converted.filtered = converted.failed = true;
+        converted.uid = ViewOf(icalcomponent_get_uid(c));
+        converted.isarecurrence = icalcomponent_count_properties(c, ICAL_RECURRENCEID_PROPERTY) > 0;
+        if (converted.isarecurrence) {
+            icaltimetype recurrenceid = icalcomponent_get_recurrenceid(c);
+            converted.recurrenceid = icaltime_as_timet_with_zone(recurrenceid, icaltime_get_timezone(recurrenceid));
+        }
+        converted.log = "    ==> Processing event <==\n    UID: " + converted.uid + "\n    Filtered out by " + filteredby + "\n";
+        return converted;
+    }
+
+    if (cache.enabled) {
+        converted.hash = HashComponent(c, cache.seed);
+        auto found = cache.entries.find(converted.hash);
+        if (found != cache.entries.end() && UnpackConverted(found->second, converted) &&
+                converted.uid == ViewOf(icalcomponent_get_uid(c))) { // a final check against the (unlikely) hash collision
+            converted.cached = true;
+            converted.packed = found->second;
+        }
+    }
+    if (!converted.cached) {
+        uint64_t hash = converted.hash;
+        converted = ConvertEventFields(c, options);
+        converted.hash = hash;
+        if (cache.enabled) {
+            converted.packed = PackConverted(converted);
+        }
+    }
+
+    std::ostringstream log;
+    bool &failed = converted.failed;
+    Appointment &appointment = converted.appointment;
+
+    icalproperty *rrule = icalcomponent_get_first_property(c, ICAL_RRULE_PROPERTY);
+    if (rrule != nullptr) {
+        icalrecurrencetype recur = icalproperty_get_rrule(rrule);
+
+        // move the start and end of the repeats to be inside the sync window
+        if (!failed && !ClipRecurrence(c, appointment, recur, options.windowstart, options.windowend, log)) {
+            failed = true;
+            log << "    No repeats inside the sync window" << std::endl;
+        }
+
+        // the palm can't represent this repeat, fall back to copying the individual events within EXPANDDAYS
+        if (failed && options.expandend > 0 && options.expandmax > 0) {
+            converted.instances = ExpandRecurrence(c, appointment, recur, options.windowstart, options.expandend, options.expandmax);
+            log << "        Expanding into " << converted.instances.size() << " individual events instead" << std::endl;
+        }
+    }
+
+    converted.log += log.str();
+    return converted;
+}
+
+
 int main(int argc, char **argv) {
 
     // configuration settings & defaults
     std::string configfile(DEFAULT_CONFIG_FILE);
     std::vector<std::string> alluris;
     std::string port, timezone("UTC");
-    int fromyear = 0, previousdays = 0;
+    int fromyear = 0, previousdays = 0, futuredays = 0, expanddays = 180, expandmax = 50, maxbytes = 0, serialrate = 0, closetimeout = 10, threads = 0;
+    int fetchconnecttimeout = 15, fetchtimeout = 60, fetchretries = 2;
+    std::string dlptracefile, convertcache, statedir, fetchfailure("exit"), prepareuser, charset("cp1252"), unmappable("?");
+    int feedmaxage = 0;
     bool dohotsync = true, readonly = false, doalarms = false, skipnotes = false, overwrite = true, onlynew = false, secure = false;
-    bool portoverride = false, urioverride = false; // command line argument overrides config file argument
+    bool deduplicate = true, serialauto = false, dotrace = false, categories = false, prefilter = true, pipeline = true;
+    bool portoverride = false, urioverride = false, rateoverride = false; // command line argument overrides config file argument
+    std::vector<EventFilter> filters;
 
     // use to keep track if something happened or not (often for exiting on an error)
     bool failed = true;
@@ -88,7 +554,7 @@ int main(int argc, char **argv) {
     std::cout << "    ==> Reading arguments <==" << std::endl << std::flush;
 
     // based on https://www.gnu.org/software/libc/manual/html_node/Example-of-Getopt.html
-    for (int c; (c = getopt(argc, argv, "hp:u:c:")) != -1; ) { // man 3 getopt
+    for (int c; (c = getopt(argc, argv, "hp:P:u:c:s:")) != -1; ) { // man 3 getopt
         switch (c) {
             case 'h': // port
                 std::cout << "    Argument -h" << std::endl;
@@ -110,6 +576,24 @@ int main(int argc, char **argv) {
                 portoverride = true;
                 break;
 
+            case 'P': // prepare a profile
+                failed = false;
+                prepareuser = optarg;
+                std::cout << "    Argument -P: " << prepareuser << std::endl;
+                break;
+
+            case 's': // serial rate
+                failed = false;
+                if (strcmp(optarg, "auto") == 0) {
+                    serialauto = true;
+                }
+                else {
+                    serialrate = atoi(optarg);
+                }
+                std::cout << "    Argument -s: " << optarg << std::endl;
+                rateoverride = true;
+                break;
+
             case 'c': // config file
                 failed = false;
                 configfile = optarg;
@@ -155,23 +639,10 @@ int main(int argc, char **argv) {
     if (!urioverride) {
         failed = false;
         if (cfg.exists("URI")) {
-            libconfig::Setting& urisettings = cfg.lookup("URI");
-            if (urisettings.isList()) {
-                for (libconfig::Setting const& urisetting : urisettings) {
-                    if (urisetting.getType() == libconfig::Setting::TypeString) {
-                        alluris.push_back(std::string(urisetting));
-                    }
-                }
-            }
-            else if (urisettings.getType() == libconfig::Setting::TypeString){
-                alluris.push_back(std::string(urisettings));
-            }
-            else {
-                failed = true;
-            }
+            failed = !ReadURIs(cfg.lookup("URI"), alluris);
         }
         else {
-            failed = true;
+            failed = !cfg.exists("PROFILES"); // the URIs could all be in the profiles
         }
         if (failed) {
             std::cerr << "    ERROR with URI setting in configuration file, failing." << std::endl;
@@ -188,21 +659,90 @@ int main(int argc, char **argv) {
     if (!portoverride) {
         FAIL_CFG(PORT, port)
     }
+    if (!rateoverride) {
+        NON_FAIL_CFG(SERIALRATE, serialrate)
+        NON_FAIL_CFG(SERIALAUTO, serialauto)
+    }
+    NON_FAIL_CFG(CLOSETIMEOUT, closetimeout)
     NON_FAIL_CFG(DOHOTSYNC, dohotsync)
+    NON_FAIL_CFG(DLPTRACE, dotrace)
+    NON_FAIL_CFG(DLPTRACEFILE, dlptracefile)
     NON_FAIL_CFG(READONLY, readonly)
     NON_FAIL_CFG(TIMEZONE, timezone)
     NON_FAIL_CFG(FROMYEAR, fromyear)
     NON_FAIL_CFG(PREVIOUSDAYS, previousdays)
+    NON_FAIL_CFG(FUTUREDAYS, futuredays)
+    NON_FAIL_CFG(EXPANDDAYS, expanddays)
+    NON_FAIL_CFG(EXPANDMAX, expandmax)
     NON_FAIL_CFG(SKIPNOTES, skipnotes)
+    NON_FAIL_CFG(MAXBYTES, maxbytes)
     NON_FAIL_CFG(OVERWRITE, overwrite)
     NON_FAIL_CFG(ONLYNEW, onlynew)
     NON_FAIL_CFG(DOALARMS, doalarms)
     NON_FAIL_CFG(SECURE, secure)
+    NON_FAIL_CFG(DEDUPLICATE, deduplicate)
+    NON_FAIL_CFG(THREADS, threads)
+    NON_FAIL_CFG(CONVERTCACHE, convertcache)
+    NON_FAIL_CFG(STATEDIR, statedir)
+    NON_FAIL_CFG(CATEGORIES, categories)
+    NON_FAIL_CFG(PREFILTER, prefilter)
+    NON_FAIL_CFG(PIPELINE, pipeline)
+    NON_FAIL_CFG(FETCHCONNECTTIMEOUT, fetchconnecttimeout)
+    NON_FAIL_CFG(FETCHTIMEOUT, fetchtimeout)
+    NON_FAIL_CFG(FETCHRETRIES, fetchretries)
+    NON_FAIL_CFG(FETCHFAILURE, fetchfailure)
+    // a sync station with profiles is expected to prepare them with -P, so by default what was fetched and
+    // prepared in the last 15 minutes is used without waiting on the calendars to be fetched again
+    if (cfg.exists("PROFILES")) {
+        feedmaxage = 900;
+    }
+    NON_FAIL_CFG(FEEDMAXAGE, feedmaxage)
+    NON_FAIL_CFG(CHARSET, charset)
+    if (charset != "cp1252" && charset != "utf8") {
+        std::cout << "    Unknown CHARSET setting, assuming cp1252." << std::endl;
+        charset = "cp1252";
+    }
+    NON_FAIL_CFG(UNMAPPABLE, unmappable)
+    if (charset == "cp1252") {
+        TranscodeForPalm(unmappable.data(), 0); // it's UTF-8 like everything else
+        unmappable.resize(strlen(unmappable.c_str()));
+    }
+    if (unmappable.length() > 1) {
+        std::cout << "    UNMAPPABLE should be a single character, using " << unmappable[0] << "." << std::endl;
+    }
+    if (fetchfailure != "exit" && fetchfailure != "skip" && fetchfailure != "lastgood") {
+        std::cout << "    Unknown FETCHFAILURE setting, assuming exit." << std::endl;
+        fetchfailure = "exit";
+    }
+    if (cfg.exists("FILTERS")) {
+        if (!LoadFilters(cfg.lookup("FILTERS"), filters)) {
+            std::cerr << "    ERROR with FILTERS setting in configuration file, failing." << std::endl;
+            return EXIT_FAILURE;
+        }
+        for (EventFilter &filter : filters) {
+            std::cout << "    Config FILTERS: " << (filter.uri.length() > 0 ? filter.uri : "all calendars") << std::endl;
+        }
+    }
+    else {
+        std::cout << "    No FILTERS setting, assuming none." << std::endl;
+    }
+    if (threads <= 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    if (prepareuser.length() > 0) {
+        dohotsync = false; // preparing a profile happens without the palm
+    }
     std::cout << std::endl << std::flush;
 
 
     /** palm pilot communication part 1 **/
 
+    ALLOC_STAGE(Connect);
+
+    if (dotrace) {
+        dlptrace.start(dlptracefile);
+    }
+
     int sd = -1; // socket descriptor (like an fid)
     PilotUser User;
 
@@ -212,645 +752,828 @@ int main(int argc, char **argv) {
 
         // a lot of this comes from pilot-link userland.c, pilot-install-datebook.c, or pilot-read-ical.c
 
-        if ((sd = pi_socket(PI_AF_PILOT, PI_SOCK_STREAM, PI_PF_DLP)) < 0) {
-            std::cerr << "    ERROR unable to create socket '" << port << "'" << std::endl;
-            return EXIT_FAILURE;
-        }
-
-        if (pi_bind(sd, port.c_str()) < 0) {
-            std::cerr << "    ERROR unable to bind to port: " << port << std::endl;
-            return EXIT_FAILURE;
-        }
-
-        std::cout << "    Listening for incoming connection on " << port << "... " << std::flush;
-
-        if (pi_listen(sd, 1) < 0) {
-            std::cerr << std::endl << "    ERROR listening on " << port << std::endl;
-            pi_close_fixed(sd, port);
-            return EXIT_FAILURE;
-        }
-
-        sd = pi_accept_to(sd, 0, 0, 0); // last argument is a timeout in seconds - 0 is wait forever?
-        if (sd < 0) {
-            std::cerr << "    ERROR accepting data on " << port << std::endl;
-            pi_close_fixed(sd, port);
-            return EXIT_FAILURE;
-        }
-
-        std::cout << "connected!" << std::endl << std::endl << std::flush;
-
-        SysInfo sys_info;
-        if (dlp_ReadSysInfo(sd, &sys_info) < 0) {
-            std::cerr << "    ERROR reading system info on " << port << std::endl;
-            pi_close_fixed(sd, port);
-            return EXIT_FAILURE;
+        // serial connections can be asked to go faster than the pilot-link default, in auto mode start at
+        // the fastest rate and work down until the link is reliable (each try needs another HotSync press)
+        bool isserial = port.find("usb:") != 0 && port.find("net:") != 0;
+        std::vector<int> rates;
+        if (isserial && serialauto) {
+            if (serialrate > SerialRates[0]) {
+                rates.push_back(serialrate);
+            }
+            for (int rate : SerialRates) {
+                if (serialrate == 0 || rate <= serialrate) {
+                    rates.push_back(rate);
+                }
+            }
         }
-
-        dlp_ReadUserInfo(sd, &User);
-
-        // tell the palm we're going to be communicating
-        if (dlp_OpenConduit(sd) < 0) {
-            std::cerr << "    ERROR opening conduit with Palm" << std::endl;
-            pi_close_fixed(sd, port);
-            return EXIT_FAILURE;
+        else {
+            rates.push_back(isserial ? serialrate : 0);
         }
 
-    }
-
-
-    /** read in calendar data using libcurl **/
+        for (int attempt = 0; attempt < rates.size(); attempt++) {
+            bool lastattempt = attempt == rates.size() - 1;
 
-    // store all of the calendar events packed ready for copying to the palm
-    std::vector<Appointment> Appointments;
-    std::vector<std::string> uids; // for detecting & merging duplicate ical entries
-    std::vector<bool> docopy; // actually copy to the palm?
-    for (std::string uri : alluris) {
-
-        std::cout << "    ==> Downloading calendar <==" << std::endl << std::flush;
-
-        // the downloaded ical data
-        std::string icaldata;
+            if ((sd = pi_socket(PI_AF_PILOT, PI_SOCK_STREAM, PI_PF_DLP)) < 0) {
+                std::cerr << "    ERROR unable to create socket '" << port << "'" << std::endl;
+                return EXIT_FAILURE;
+            }
 
-        failed = false;
-        CURL *curl;
-        CURLcode res;
-        curl_global_init(CURL_GLOBAL_DEFAULT);
-        curl = curl_easy_init();
-        if(curl) {
-            std::cout << "    Fetching " << uri << std::endl;
+            // the rate to ask for when the palm connects
+            if (rates[attempt] > 0) {
+                size_t ratesize = sizeof(rates[attempt]);
+                pi_setsockopt(sd, PI_LEVEL_DEV, PI_DEV_ESTRATE, &rates[attempt], &ratesize);
+            }
 
-            curl_easy_setopt(curl, CURLOPT_URL, uri.c_str());
+            if (pi_bind(sd, port.c_str()) < 0) {
+                std::cerr << "    ERROR unable to bind to port: " << port << std::endl;
+                return EXIT_FAILURE;
+            }
 
-            // disable some SSL checks, reduced security
-            if (!secure) {
-                curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
-                curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
+            std::cout << "    Listening for incoming connection on " << port;
+            if (rates[attempt] > 0) {
+                std::cout << " at " << rates[attempt] << " baud";
             }
+            std::cout << "... " << std::flush;
 
-            // cache the CA cert bundle in memory for a week
-            curl_easy_setopt(curl, CURLOPT_CA_CACHE_TIMEOUT, 604800L);
+            if (DLP(pi_listen(sd, 1), 0, 0) < 0) {
+                std::cerr << std::endl << "    ERROR listening on " << port << std::endl;
+                pi_close_fixed(sd, port, closetimeout);
+                return EXIT_FAILURE;
+            }
 
-            // tell curl to write to a std::string
-            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, CurlWrite_CallbackFunc_StdString);
-            curl_easy_setopt(curl, CURLOPT_WRITEDATA, &icaldata);
-            curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, true);
+            int listensd = sd;
+            sd = DLP(pi_accept_to(sd, 0, 0, 0), 0, 0); // last argument is a timeout in seconds - 0 is wait forever?
+            if (sd < 0) {
+                std::cerr << "    ERROR accepting data on " << port << std::endl;
+                if (!lastattempt) {
+                    std::cout << "    Trying a slower rate, press HotSync again" << std::endl << std::flush;
+                    DLP(pi_close(listensd), 0, 0); // so the port can be bound again
+                    continue;
+                }
+                pi_close_fixed(sd, port, closetimeout);
+                return EXIT_FAILURE;
+            }
 
-            // perform the request, res will get the return code
-            res = curl_easy_perform(curl);
+            std::cout << "connected!" << std::endl << std::endl << std::flush;
 
-            // check for errors
-            if (res != CURLE_OK) {
-                std::cerr << "    ERROR curl_easy_perform() failed: " << curl_easy_strerror(res) << std::endl;
-                failed = true;
+            SysInfo sys_info;
+            if (DLP(dlp_ReadSysInfo(sd, &sys_info), 0, sizeof(sys_info)) < 0) {
+                std::cerr << "    ERROR reading system info on " << port << std::endl;
+                if (!lastattempt) {
+                    std::cout << "    Trying a slower rate, press HotSync again" << std::endl << std::flush;
+                    pi_close_fixed(sd, port, closetimeout);
+                    DLP(pi_close(listensd), 0, 0); // so the port can be bound again
+                    continue;
+                }
+                pi_close_fixed(sd, port, closetimeout);
+                return EXIT_FAILURE;
             }
-            else {
-                long http_code = 0;
-                curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
-                char *scheme;
-                curl_easy_getinfo(curl, CURLINFO_SCHEME, &scheme);
-                if (http_code != 200 && !(strcmp(scheme, "FILE") == 0)) {
-                    std::cerr << "    ERROR fetching URI, http response code " << http_code << std::endl;
-                    failed = true;
+
+            // check how fast the link really is (the palm may have settled on a slower rate)
+            if (isserial) {
+                int rate = 0;
+                size_t ratesize = sizeof(rate);
+                pi_getsockopt(sd, PI_LEVEL_DEV, PI_DEV_RATE, &rate, &ratesize);
+
+                double throughput = ProbeLink(sd);
+                if (throughput < 0) {
+                    std::cerr << "    ERROR testing link at " << rate << " baud" << std::endl;
+                    if (!lastattempt) {
+                        std::cout << "    Trying a slower rate, press HotSync again" << std::endl << std::flush;
+                        pi_close_fixed(sd, port, closetimeout);
+                        DLP(pi_close(listensd), 0, 0); // so the port can be bound again
+                        continue;
+                    }
+                    pi_close_fixed(sd, port, closetimeout);
+                    return EXIT_FAILURE;
                 }
+                std::cout << "    Connected at " << rate << " baud";
+                if (throughput > 0) {
+                    std::cout << ", measured " << (int)throughput << " bytes/s";
+                }
+                std::cout << std::endl << std::endl << std::flush;
             }
 
-            // always cleanup!
-            curl_easy_cleanup(curl);
-        }
-        else {
-            std::cerr << "    ERROR initialising curl" << std::endl;
+            break;
         }
 
-        curl_global_cleanup();
-     
-        if (failed) {
-            // something went wrong along the way, exit
-            std::cerr << "    Exiting after curl error" << std::endl << std::endl;
-            if (dohotsync) {
-                pi_close_fixed(sd, port);
-            }
+        DLP(dlp_ReadUserInfo(sd, &User), 0, sizeof(User));
+
+        // tell the palm we're going to be communicating
+        if (DLP(dlp_OpenConduit(sd), 0, 0) < 0) {
+            std::cerr << "    ERROR opening conduit with Palm" << std::endl;
+            pi_close_fixed(sd, port, closetimeout);
             return EXIT_FAILURE;
         }
-        std::cout << "    Calendar downloaded successfully" << std::endl << std::endl << std::flush;
 
+    }
 
-        /** parse calendar using libical **/
 
-        std::cout << "    ==> Parsing calendar <==" << std::endl << std::flush;
+    /** pick the profile for this palm **/
 
-        // ical specifies components, properties, values, and parameters and I think there's
-        // a bit of a metaphor relating that to HTML, with COMPONENTS corresponding to an
-        // opening BEGIN tag which contains PROPERTY tags that then have VALUES (the main
-        // thing in that tag, and then PARAMETERS which are kind of like HTML attributes,
-        // adding extra information about the PARAMETER
-
-        // https://github.com/libical/libical/blob/master/doc/UsingLibical.md
-        // https://libical.github.io/libical/apidocs/icalcomponent_8h.html
-        // https://libical.github.io/libical/apidocs/icalproperty_8h.html
-        // https://libical.github.io/libical/apidocs/icalparameter_8h.html
-        // https://libical.github.io/libical/apidocs/icaltime_8h.html
-        // https://libical.github.io/libical/apidocs/structicaltimetype.html
-        
-        // parse the string into a series of components to iterate through
-        icalcomponent* components = icalparser_parse_string(icaldata.c_str());
+    // a sync station serving several palms can have a profile for each palm user in PROFILES, which
+    // overrides the settings above, the same profile is used with -P to prepare ahead of a HotSync
+    std::string profileuser = dohotsync ? User.username : prepareuser;
+    if (cfg.exists("PROFILES") && profileuser.length() > 0) {
+        const libconfig::Setting *profile = FindProfile(cfg.lookup("PROFILES"), profileuser);
+        if (profile == nullptr) {
+            std::cout << "    No profile for " << profileuser << ", using the main settings" << std::endl << std::endl;
+        }
+        else {
+            std::cout << "    ==> Using profile for " << profileuser << " <==" << std::endl << std::flush;
+            if (!urioverride && profile->exists("URI")) {
+                alluris.clear();
+                if (!ReadURIs(profile->lookup("URI"), alluris)) {
+                    std::cerr << "    ERROR with URI setting in profile, failing." << std::endl;
+                    if (dohotsync) {
+                        pi_close_fixed(sd, port, closetimeout);
+                    }
+                    return EXIT_FAILURE;
+                }
+                for (std::string uri : alluris) {
+                    std::cout << "    Profile URI: " << uri << std::endl;
+                }
+            }
+            PROFILE_CFG(FROMYEAR, fromyear)
+            PROFILE_CFG(PREVIOUSDAYS, previousdays)
+            PROFILE_CFG(FUTUREDAYS, futuredays)
+            PROFILE_CFG(EXPANDDAYS, expanddays)
+            PROFILE_CFG(EXPANDMAX, expandmax)
+            PROFILE_CFG(SKIPNOTES, skipnotes)
+            PROFILE_CFG(MAXBYTES, maxbytes)
+            PROFILE_CFG(OVERWRITE, overwrite)
+            PROFILE_CFG(ONLYNEW, onlynew)
+            PROFILE_CFG(DOALARMS, doalarms)
+            PROFILE_CFG(DEDUPLICATE, deduplicate)
+            PROFILE_CFG(CATEGORIES, categories)
+
+            // each profile needs its own conversion cache, as a cache only keeps the events from its last run
+            if (!profile->lookupValue("CONVERTCACHE", convertcache) && convertcache.length() > 0) {
+                convertcache += "." + std::to_string(Hash64(profileuser));
+            }
+            if (convertcache.length() > 0) {
+                std::cout << "    Profile CONVERTCACHE: " << convertcache << std::endl;
+            }
 
-        // remove errors (which also includes empty descriptions, locations, and the like) 
-        icalcomponent_strip_errors(components);
+            if (profile->exists("FILTERS")) {
+                filters.clear();
+                if (!LoadFilters(profile->lookup("FILTERS"), filters)) {
+                    std::cerr << "    ERROR with FILTERS setting in profile, failing." << std::endl;
+                    if (dohotsync) {
+                        pi_close_fixed(sd, port, closetimeout);
+                    }
+                    return EXIT_FAILURE;
+                }
+                for (EventFilter &filter : filters) {
+                    std::cout << "    Profile FILTERS: " << (filter.uri.length() > 0 ? filter.uri : "all calendars") << std::endl;
+                }
+            }
+            std::cout << std::endl << std::flush;
+        }
+    }
+    else if (prepareuser.length() > 0) {
+        std::cout << "    No PROFILES setting, preparing the main settings" << std::endl << std::endl;
+    }
+    if (alluris.size() == 0) {
+        std::cerr << "    ERROR no calendars to sync, failing." << std::endl;
+        if (dohotsync) {
+            pi_close_fixed(sd, port, closetimeout);
+        }
+        return EXIT_FAILURE;
+    }
 
-        // if there is some valid ical data to work through
-        if (components != nullptr) {
 
-            std::cout << "    Calendar parsed successfully" << std::endl << std::endl << std::flush;
+    /** read in calendar data using libcurl **/
 
-            // the specific component we're on in our iteration
-            icalcomponent *c;
+    // store all of the calendar events packed ready for copying to the palm
+    std::vector<Appointment> Appointments;
+    std::vector<std::string> uids; // for detecting & merging duplicate ical entries
+    std::unordered_map<std::string, int> uidindex; // uid to index in Appointments, to find them quickly
+    std::vector<bool> docopy; // actually copy to the palm?
+    std::unordered_map<int, std::vector<int>> expanded; // index of a repeating event to the individual events expanded from it
+    std::vector<int> sources; // which of alluris the event came from
+
+    // the sync window, repeating events are clipped to start and end inside it
+    // from the start of the day PREVIOUSDAYS ago (or the start of FROMYEAR) to FUTUREDAYS from now
+    time_t windowstart = (today / 86400 - previousdays) * 86400;
+    if (fromyear > 0) {
+        tm fromyear_tm = {};
+        fromyear_tm.tm_year = fromyear - 1900;
+        fromyear_tm.tm_mday = 1;
+        windowstart = std::max(windowstart, timegm(&fromyear_tm));
+    }
+    time_t windowend = futuredays > 0 ? today + (time_t)futuredays * 86400 : 0;
 
-            // we're only interested in calendar events, iterate through them
-            for(c = icalcomponent_get_first_component(components, ICAL_VEVENT_COMPONENT); c != 0;
-                    c = icalcomponent_get_next_component(components, ICAL_VEVENT_COMPONENT)) {
+    // repeating events the palm can't represent are expanded into individual events up to EXPANDDAYS from now
+    time_t expandend = today + (time_t)expanddays * 86400;
+    if (windowend > 0) {
+        expandend = std::min(expandend, windowend);
+    }
 
-                // palm only has start time, end time, alarm, repeat, description, and note
-                // so we only need to extract those things from the component if they're there
-                // every event should have a DTSTART, DTEND, and DTSUMMARY (which is palm description)
-                // palm won't take an event with a description
+    ConvertOptions options;
+    options.windowstart = windowstart;
+    options.windowend = windowend;
+    options.expandend = expanddays > 0 ? expandend : 0;
+    options.expandmax = expandmax;
+    options.skipnotes = skipnotes;
+    options.doalarms = doalarms;
+    options.transcode = charset == "cp1252";
+    options.unmappable = unmappable.length() > 0 ? unmappable[0] : 0;
+
+    // events converted on previous runs
+    ConversionCache cache;
+    std::vector<std::pair<uint64_t, std::string>> cacheentries; // the events seen this run, to write back out
+    if (convertcache.length() > 0 && !OpenConversionCache(convertcache, cache)) {
+        std::cerr << "    WARNING unable to read conversion cache " << convertcache << ", starting again" << std::endl;
+    }
 
-                std::cout << "    ==> Processing event <==" << std::endl;
-                failed = false;
+    // anything that changes how the events are converted has to change the hashes of the cached events
+    char settings[64];
+    snprintf(settings, sizeof(settings), "%d|%d|%d|%d", skipnotes, doalarms, options.transcode, options.unmappable);
+    uint64_t cacheseed = Hash64(settings);
+
+    // one curl handle is kept for all of the calendars so that connections, TLS sessions,
+    // and DNS lookups are reused between feeds (most are likely to be on the same server)
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    CURL *curl = curl_easy_init();
+    if (curl) {
+        // disable some SSL checks, reduced security
+        if (!secure) {
+            curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
+            curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
+        }
 
-                /* create Appointment if it doesn't already exist */
+        // cache the CA cert bundle in memory for a week
+        curl_easy_setopt(curl, CURLOPT_CA_CACHE_TIMEOUT, 604800L);
 
-                // use event UID to detect duplicates & merge (Google seems to split things out sometimes?)
-                icalproperty *uidp = icalcomponent_get_first_property(c, ICAL_UID_PROPERTY);
+        // keep connections alive between feeds and use HTTP/2 if the server offers it
+        curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+        curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+        curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
 
-                bool isarecurrence = icalcomponent_count_properties(c, ICAL_RECURRENCEID_PROPERTY) > 0;
+        // don't let a slow or hung server keep the palm waiting forever
+        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, (long)fetchconnecttimeout);
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT, (long)fetchtimeout);
 
-                std::string uid("");
-                if (uidp != nullptr) {
-                    uid = icalproperty_get_uid(uidp);
-                    if (!isarecurrence) {
-                        std::cout << "    UID: " << uid << std::endl;
-                    }
-                    else {
-                        std::cout << "    Recurrence of UID: " << uid << std::endl;
-                    }
-                }
+        // ics is plain text and compresses well, "" asks for all encodings curl was built with (gzip, br, ...)
+        curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
 
+        // tell curl to write to a std::string
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, CurlWrite_CallbackFunc_StdString);
+        curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, true);
+    }
 
-                int uidmatched = -1;
-                for (int i = 0; i < uids.size(); i++) {
-                    if (uids[i] == uid && uid != "") {
-                        std::cout << "        Previous UID match" << std::endl;
-                        uidmatched = i;
-                        break;
-                    }
-                }
+    std::vector<bool> fetched(alluris.size(), true); // false for calendars skipped after failing to fetch
+    std::vector<std::string> feeds(alluris.size()); // the downloaded ical data
+    std::vector<LocalCalendar> locals(alluris.size()); // files and stdin don't need downloading, libical reads them directly
 
-                // store information about this event in the pilot-link Appointment struct
-                // see pi-datebook.h for details of format
-                Appointment appointment;
 
-                if (uidmatched != -1 && !isarecurrence) {
-                    // if this uid exists twice, assume the later one in the file is newer and overwrite any properties specified
-                    // it can only be allowed to match a previous UID if there's not a RECURRENCE-ID
-                    appointment = Appointments[uidmatched];
-                }
+    /** use the calendar prepared for this palm **/
 
+    // a calendar prepared (with -P) with the same settings today is written as it is, straight away if it was
+    // prepared in the last FEEDMAXAGE seconds, otherwise if the calendars fetched now are what it was made from
+    // (local calendars are read as they're parsed, so can't be checked and are never prepared)
+    std::string preparedfile;
+    uint64_t settingskey = 0, contentkey = 0;
+    bool prepared = false;
+    bool anylocal = false;
+    for (const std::string &uri : alluris) {
+        anylocal = anylocal || uri == "-" || uri.find("file://") == 0;
+    }
 
-                /* date time description essentials */
+    // the config file covers FILTERS and the rest of the settings, but not the ones given as arguments,
+    // and the date is the one in TIMEZONE so that a calendar prepared in the evening lasts until midnight
+    std::string configdata;
+    ReadWholeFile(configfile, configdata);
+    char preparesettings[256];
+    snprintf(preparesettings, sizeof(preparesettings), "%d|%ld|%d|%d|%d|%d|%d|%d|%d|%d|%d|%d|%d|%s",
+        CONVERSION_CACHE_VERSION, LocalDate(today, timezone), fromyear, previousdays, futuredays, expanddays, expandmax,
+        skipnotes, doalarms, deduplicate, prefilter, options.transcode, options.unmappable, timezone.c_str());
+    settingskey = Hash64(configdata, Hash64(preparesettings));
+    for (const std::string &uri : alluris) {
+        settingskey = Hash64(uri, settingskey);
+    }
 
-                // convert dates and times to tm for transfer to palm
-                icaltimetype start = icalcomponent_get_dtstart(c);
-                time_t start_time_t = icaltime_as_timet_with_zone(start, icaltime_get_timezone(start));
-                appointment.begin = *gmtime(&start_time_t); // dereference to avoid subsequent calls overwriting
-                timegm(&appointment.begin); // convert localtime to UTC
-                std::cout << "    Start UTC: " << asctime(&appointment.begin);
+    if (statedir.length() > 0 && profileuser.length() > 0 && !anylocal) {
+        preparedfile = PreparedFile(statedir, profileuser);
+
+        struct stat preparedstat;
+        if (dohotsync && feedmaxage > 0 && stat(preparedfile.c_str(), &preparedstat) == 0 &&
+                today - preparedstat.st_mtime < feedmaxage &&
+                LoadPrepared(preparedfile, settingskey, 0, Appointments, docopy, sources, fetched)) {
+            prepared = true;
+            std::cout << "    ==> Using the calendar prepared for " << profileuser << " <==" << std::endl;
+            std::cout << "    " << Appointments.size() << " events prepared in the last " << feedmaxage
+                << " seconds, nothing to fetch, parse, or convert" << std::endl << std::endl << std::flush;
+        }
+    }
 
-                icaltimetype end = icalcomponent_get_dtend(c);
-                time_t end_time_t = icaltime_as_timet_with_zone(end, icaltime_get_timezone(end));
-                appointment.end = *gmtime(&end_time_t);
-                timegm(&appointment.end);
-                std::cout << "    End UTC: " << asctime(&appointment.end);
+    // every calendar is fetched before any are parsed, so that if they're what a profile was prepared
+    // from with -P, none of them need parsing
+    for (int source = 0; source < alluris.size() && !prepared; source++) {
+        std::string uri = alluris[source];
 
-                // if it's just a date in ical the appointment is an all day event
-                if (icaltime_is_date(start) && icaltime_is_date(end))
-                    appointment.event          = 1;
-                else
-                    appointment.event          = 0;
+        ALLOC_STAGE(Fetch);
+        std::cout << "    ==> Downloading calendar <==" << std::endl << std::flush;
 
-                // there is some tedious conversion from char to const char to string and around things
-                // (probably a side effect of mixing C and C++)
+        std::string &icaldata = feeds[source];
+        LocalCalendar &local = locals[source];
+        bool islocal = uri == "-" || uri.find("file://") == 0;
+
+        // a copy fetched recently enough (e.g., by -P ahead of the HotSync) is used as it is
+        bool recent = false;
+        if (!islocal && feedmaxage > 0 && statedir.length() > 0) {
+            std::string feedfile = FeedFile(statedir, uri);
+            struct stat feedstat;
+            recent = stat(feedfile.c_str(), &feedstat) == 0 && today - feedstat.st_mtime < feedmaxage &&
+                ReadWholeFile(feedfile, icaldata);
+        }
 
-                // get the summary
-                std::string summary("");
-                const char* summary_c = icalcomponent_get_summary(c);
-                if (summary_c != nullptr) {
-                    summary = summary_c;
-                }
+        failed = false;
+        CURLcode res;
+        if (islocal) {
+            std::cout << "    Reading " << (uri == "-" ? "stdin" : uri) << std::endl;
+            failed = !OpenLocalCalendar(uri, local);
+        }
+        else if (recent) {
+            std::cout << "    Using the copy of " << uri << " fetched in the last " << feedmaxage << " seconds" << std::endl;
+        }
+        else if(curl) {
+            std::cout << "    Fetching " << uri << std::endl;
 
-                // get the description / note
-                std::string description("");
-                const char* description_c = icalcomponent_get_description(c);
-                if (description_c != nullptr) {
-                    description = description_c;
-                }
+            curl_easy_setopt(curl, CURLOPT_URL, uri.c_str());
+            curl_easy_setopt(curl, CURLOPT_WRITEDATA, &icaldata);
 
-                // if there's no summary and a 1 line description, use the description as a summary instead
-                // (mostly for the ical recur checks really)
-                if (summary.length() == 0 && description.length() > 0 && description.find("\n") == std::string::npos) {
-                    summary = description;
-                    description = "";
+            // try a few times, waiting a little longer each time, in case the server is just having a moment
+            for (int attempt = 0; attempt <= fetchretries; attempt++) {
+                if (attempt > 0) {
+                    int wait = std::min(1 << (attempt - 1), 8);
+                    std::cout << "    Retrying in " << wait << " seconds..." << std::endl << std::flush;
+                    std::this_thread::sleep_for(std::chrono::seconds(wait));
+                    icaldata.clear();
                 }
+                failed = false;
+                bool retry = true;
 
-                if (summary.length() > 0) {
-                    std::cout << "    Summary: " << summary << std::endl;
+                // perform the request, res will get the return code
+                res = curl_easy_perform(curl);
 
-                    // an annoying round about route from const char* to std::string to char*
-                    // https://stackoverflow.com/questions/7352099/stdstring-to-char
-                    char *summary_c2 = new char[summary.length()+1];
-                    strcpy(summary_c2, summary.c_str());
-                    appointment.description        = summary_c2;
+                // check for errors
+                if (res != CURLE_OK) {
+                    std::cerr << "    ERROR curl_easy_perform() failed: " << curl_easy_strerror(res) << std::endl;
+                    failed = true;
+                    retry = res != CURLE_UNSUPPORTED_PROTOCOL && res != CURLE_URL_MALFORMAT;
                 }
-                else if (uidmatched == -1 || isarecurrence) { // only apply default if it's not part of merging another appointment
-                    appointment.description        = nullptr;
+                else {
+                    long http_code = 0;
+                    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+                    char *scheme;
+                    curl_easy_getinfo(curl, CURLINFO_SCHEME, &scheme);
+                    if (http_code != 200 && !(strcmp(scheme, "FILE") == 0)) {
+                        std::cerr << "    ERROR fetching URI, http response code " << http_code << std::endl;
+                        failed = true;
+                        // only server errors and rate limiting are worth trying again
+                        retry = http_code >= 500 || http_code == 408 || http_code == 429;
+                    }
                 }
 
-                // get the location (palmos5 has a location but pilot-link doesn't support it - different database format?)
-                std::string location("");
-                const char* location_c = icalcomponent_get_location(c);
-                if (location_c != nullptr) {
-                    location = location_c;
+                if (!failed || !retry) {
+                    break;
                 }
+            }
+        }
+        else {
+            std::cerr << "    ERROR initialising curl" << std::endl;
+            failed = true;
+        }
 
-                // merge location and description into the note
-                std::string note;
-                if (location.length() > 0) {
-                    note = note + "Location:\n" + location;
-                }
+        // fall back on the last copy of the calendar that was fetched, or go without it
+        if (failed && fetchfailure == "lastgood" && !islocal && statedir.length() > 0 &&
+                ReadWholeFile(FeedFile(statedir, uri), icaldata)) {
+            std::cerr << "    WARNING using the last copy of this calendar that could be fetched" << std::endl;
+            failed = false;
+        }
+        else if (failed && fetchfailure != "exit") {
+            std::cerr << "    WARNING skipping this calendar" << std::endl << std::endl;
+            fetched[source] = false;
+            continue;
+        }
+        else if (!failed && (fetchfailure == "lastgood" || feedmaxage > 0) && !islocal && !recent && statedir.length() > 0) {
+            if (!WriteWholeFile(FeedFile(statedir, uri), icaldata)) {
+                std::cerr << "    WARNING unable to keep a copy of this calendar: " << strerror(errno) << std::endl;
+            }
+        }
 
-                // add attendees list to the note
-                int numattendees = icalcomponent_count_properties(c, ICAL_ATTENDEE_PROPERTY);
-                if (numattendees > 0) {
-                    
-                    std::cout << "    " << numattendees << " attendees" << std::endl;
+        if (failed) {
+            // something went wrong along the way, exit
+            std::cerr << "    Exiting after curl error" << std::endl << std::endl;
+            curl_easy_cleanup(curl);
+            curl_global_cleanup();
+            if (dohotsync) {
+                pi_close_fixed(sd, port, closetimeout);
+            }
+            return EXIT_FAILURE;
+        }
+        std::cout << "    Calendar downloaded successfully" << std::endl << std::endl << std::flush;
+    }
 
-                    if (note.length() > 0) {
-                        note = note + "\n\n";
-                    }
-                    note = note + "Attendees:";
 
-                    for(icalproperty *attendeep = icalcomponent_get_first_property(c, ICAL_ATTENDEE_PROPERTY); attendeep != 0;
-                            attendeep = icalcomponent_get_next_property(c, ICAL_ATTENDEE_PROPERTY)) {
+    // otherwise the calendars have to be what it was prepared from (what the calendars are is also what a
+    // pipelined sync is checked against to see if anything's changed, see below)
+    if (statedir.length() > 0 && !prepared) {
+        contentkey = settingskey;
+        for (int source = 0; source < alluris.size(); source++) {
+            LocalCalendar &local = locals[source];
+            if (!fetched[source]) {
+                contentkey = Hash64("skipped", contentkey);
+            }
+            else if (local.stream != nullptr) {
+                contentkey = 0; // stdin can't be looked at ahead of time
+                break;
+            }
+            else if (local.map != nullptr) {
+                contentkey = Hash64(std::string_view(local.map, local.length), contentkey);
+            }
+            else {
+                contentkey = Hash64(feeds[source], contentkey);
+            }
+        }
 
-                        std::string attendee = icalproperty_get_attendee(attendeep);
+        if (preparedfile.length() > 0 && dohotsync && LoadPrepared(preparedfile, settingskey, contentkey, Appointments, docopy, sources, fetched)) {
+            prepared = true;
+            std::cout << "    ==> Using the calendar prepared for " << profileuser << " <==" << std::endl;
+            std::cout << "    " << Appointments.size() << " events, nothing to parse or convert" << std::endl << std::endl << std::flush;
+        }
+    }
 
-                        icalparameter *cnp2 = icalproperty_get_first_parameter(attendeep, ICAL_CN_PARAMETER);
-                        std::string attendee_cn("");
-                        if (cnp2 != nullptr) {
-                            attendee_cn = icalparameter_get_iana_value(cnp2);
-                        }
 
-                        if (attendee_cn != "") {
-//                            std::cout << "CN: " << attendee_cn << std::endl;
-                            note = note + "\n" + attendee_cn;
-                        }
-                        else {
-                            // if there's no CN (common name) fall back to the base value which is usually an e-mail address
-                            int k = attendee.find("mailto:");
-                            if (k != std::string::npos) {
-                                // strip off the mailto
-                                attendee = attendee.substr(7);
-                            }
-                            note = note + "\n" + attendee_cn;
-                        }
 
-                    }
+    /** write to the palm as the calendars are converted **/
 
-                } // numattendees
+    // with OVERWRITE (and without CATEGORIES) the whole datebook is replaced, so there's no need to wait for
+    // everything to be converted before writing to the palm. an event is finished with as soon as it's been
+    // converted, unless another event with the same UID (e.g., a moved repeat) can still change it, so the
+    // UIDs in all of the calendars are counted first and those events are left until the end. the records are
+    // handed through a queue to a thread writing them to the palm while the next chunk of events is converted
+    // (not when a sync might be resumed, as that needs to know everything that's to be written, or when a
+    // calendar is read from stdin, as it can't be looked at ahead of time)
+    bool pipelined = pipeline && dohotsync && overwrite && !categories && !readonly && !prepared;
+    for (LocalCalendar &local : locals) {
+        pipelined = pipelined && local.stream == nullptr;
+    }
+    Checkpoint checkpoint;
+    std::string checkpointfile;
+    if (pipelined && statedir.length() > 0) {
+        checkpointfile = DeviceFile(statedir, "checkpoint", User);
+        pipelined = !(LoadCheckpoint(checkpointfile, checkpoint) && checkpoint.lastsync == User.lastSyncDate &&
+            checkpoint.records.size() > 0);
+        checkpoint = Checkpoint();
+    }
 
-                // add the description to the note if present
-                if (description.length() > 0) {
-                    if (note.length() > 0) {
-                        note = note + "\n\n";
-                    }
-                    note = note + description;
+    int db = -1; // the datebook on the palm
+    std::string syncstatefile;
+    SyncState syncstate;
+    LinkMeter linkmeter; // times the calls reading, deleting, and writing records during this sync
+    SPSCQueue<PipelineRecord, PIPELINE_QUEUE> pipelinequeue;
+    std::thread writer;
+    std::atomic<bool> writefailed(false);
+    int numwritten = 0, numtowrite = 0;
+    std::vector<std::pair<uint64_t, uint64_t>> pipelinewritten; // what the writer's written, for the next sync plan
+    std::unordered_map<std::string, int> uidcounts;
+    size_t pipelinebudget = 0;
+    if (pipelined) {
+        std::cout << "    ==> Writing to Palm as calendars are converted <==" << std::endl << std::flush;
+
+        // skip the whole thing if nothing's changed (see below), by the calendars themselves rather than
+        // the records converted from them, as they aren't converted yet
+        if (statedir.length() > 0) {
+            syncstatefile = DeviceFile(statedir, "sync", User);
+
+            char writesettings[64];
+            snprintf(writesettings, sizeof(writesettings), "pipelined|%d|%d|%d|%d", overwrite, onlynew, categories, maxbytes);
+            syncstate.fingerprint = Hash64(std::string_view((char*)&contentkey, sizeof(contentkey)), Hash64(writesettings));
+
+            if (contentkey != 0 && AlreadySynced(sd, syncstatefile, User, syncstate.fingerprint)) {
+                std::cout << "    Nothing has changed since the last sync, skipping" << std::endl << std::endl << std::flush;
+                DLP(dlp_AddSyncLogEntry(sd, (char*)"Appointments already up to date.\n"), 0, 0); // log on palm
+                if (pi_close_fixed(sd, port, closetimeout) < 0) {
+                    return EXIT_FAILURE;
                 }
+                return EXIT_SUCCESS;
+            }
 
-                if (note.length() > 0 && !skipnotes) { // note might be empty
+            // a sync that doesn't finish mustn't leave the last one's behind
+            remove(syncstatefile.c_str());
+        }
 
-                    std::cout << "    Note:\n" << note << std::endl;
+        if ((db = OpenDatebook(sd)) < 0 || !DeleteDatebook(sd, db)) {
+            pi_close_fixed(sd, port, closetimeout);
+            return EXIT_FAILURE;
+        }
+        DLP(dlp_CleanUpDatabase(sd, db), 0, 0);
+        DLP(dlp_ResetDBIndex(sd, db), 0, 0);
+
+        // asked for now, as the palm's the writer's once it starts (freed up by deleting the old records)
+        pipelinebudget = SpaceForRecords(sd, maxbytes);
+
+        // each record is noted down once it's written, for the next sync to resume from if this one is interrupted
+        FILE *checkpointing = nullptr;
+        if (checkpointfile.length() > 0) {
+            checkpoint.lastsync = User.lastSyncDate;
+            checkpointing = StartCheckpoint(checkpointfile, checkpoint);
+            if (checkpointing == nullptr) {
+                std::cerr << "    WARNING unable to write checkpoint " << checkpointfile << ": " << strerror(errno) << std::endl;
+            }
+        }
 
-                    char *note_c2 = new char[note.length()+1];
-                    strcpy(note_c2, note.c_str());
-                    appointment.note               = note_c2;
-                }
-                else if (uidmatched == -1 || isarecurrence) { // only apply when not merging
-                    appointment.note               = nullptr;
+        // the palm is left to the writer until it's written everything (it doesn't print anything either, as
+        // that would get mixed up with the conversion's output)
+        writer = std::thread([&, checkpointing]() {
+            for (PipelineRecord item = pipelinequeue.pop(); item.record != nullptr; item = pipelinequeue.pop()) {
+                numtowrite++;
+                if (!writefailed.load(std::memory_order_relaxed)) {
+                    recordid_t id = 0;
+                    auto start = std::chrono::steady_clock::now();
+                    if (DLP(dlp_WriteRecord(sd, db, 0, 0, 0, item.record->data, item.record->used, &id), item.record->used, 0) < 0) {
+                        // most likely the palm is full, there's no point carrying on
+                        writefailed.store(true, std::memory_order_relaxed);
+                    }
+                    else {
+                        numwritten++;
+                        AddCheckpoint(checkpointing, id, item.hash);
+                        linkmeter.add(item.record->used, start);
+                        pipelinewritten.emplace_back(item.calendar, item.hash);
+                    }
                 }
+                pi_buffer_free(item.record);
+            }
+            if (checkpointing != nullptr) {
+                fclose(checkpointing);
+            }
+        });
 
+        for (int source = 0; source < alluris.size(); source++) {
+            if (fetched[source]) {
+                CountUIDs(locals[source].map != nullptr ? std::string_view(locals[source].map, locals[source].length) :
+                    std::string_view(feeds[source]), uidcounts);
+            }
+        }
+        std::cout << std::endl << std::flush;
+    }
 
-                /* what about an alarm */
-
-                // palm os only supports one alarm, so find the nearest one and add that
-                int shortest_alarm = 9999989; // default value to c.f. if an alarm has been set
-                int numalarms = icalcomponent_count_components(c, ICAL_VALARM_COMPONENT);
-                if (numalarms > 0 && doalarms) {
+    // records are queued once they're finished with, in the same way as they'd otherwise be once everything was
+    // converted: dropping duplicates of events in calendars listed earlier, pruning exceptions, converting to
+    // TIMEZONE, packing, and fitting into the palm's memory (once space runs short notes are cut down to a
+    // preview, then records that still don't fit are left out)
+    std::vector<bool> queued; // or otherwise dealt with
+    std::unordered_map<std::string, int> pipelineseen; // content key to the calendar of the copy being kept
+    size_t pipelinebytes = 0;
+    int pipelinefolded = 0, pipelinepruned = 0, pipelinetruncated = 0, pipelinedropped = 0, pipelinequeued = 0;
+    auto queuefinished = [&](const std::vector<int> &which) {
+        queued.resize(Appointments.size(), false);
+        std::vector<int> finished;
+        for (int i : which) {
+            if (queued[i] || !docopy[i]) {
+                continue;
+            }
+            queued[i] = true;
+            if (deduplicate && alluris.size() > 1) {
+                auto match = pipelineseen.emplace(DuplicateKey(Appointments[i]), sources[i]);
+                if (!match.second && match.first->second != sources[i]) {
+                    docopy[i] = false;
+                    pipelinefolded++;
+                    continue;
+                }
+            }
+            pipelinepruned += PruneExceptions(Appointments[i]);
+            finished.push_back(i);
+        }
+        if (timezone != "UTC") {
+            ConvertTimezone(Appointments, finished, timezone);
+        }
 
-                    // a VALARM is a sub-sub-component
-                    icalcomponent *c2;
+        for (int i : finished) {
+            pi_buffer_t *record = PackAppointment(Appointments[i], pipelinetruncated, !options.transcode);
+            if (record == nullptr) {
+                docopy[i] = false;
+                pipelinedropped++;
+                continue;
+            }
+            if (pipelinebudget > 0 && pipelinebytes + record->used + RECORD_OVERHEAD > pipelinebudget &&
+                    ShortenRecord(Appointments[i], record, !options.transcode)) {
+                pipelinetruncated++;
+            }
+            if (pipelinebudget > 0 && pipelinebytes + record->used + RECORD_OVERHEAD > pipelinebudget) {
+                pi_buffer_free(record);
+                docopy[i] = false;
+                pipelinedropped++;
+                continue;
+            }
+            pipelinebytes += record->used + RECORD_OVERHEAD;
+
+            PipelineRecord item;
+            item.record = record;
+            item.calendar = Hash64(alluris[sources[i]]);
+            item.hash = Hash64(std::string_view((char*)record->data, record->used));
+            pipelinequeue.push(item);
+            pipelinequeued++;
+        }
+    };
+    std::vector<int> ready; // events finished with in the chunk being converted
 
-                    for(c2 = icalcomponent_get_first_component(c, ICAL_VALARM_COMPONENT); c2 != 0;
-                            c2 = icalcomponent_get_next_component(c, ICAL_VALARM_COMPONENT)) {
+    for (int source = 0; source < alluris.size() && !prepared; source++) {
+        std::string uri = alluris[source];
+        if (!fetched[source]) {
+            continue;
+        }
 
-                        // this is ignoring absolute alarms with TRIGGER;VALUE=DATE-TIME
-                        // also assuming there's only ever one TRIGGER property
-                        icaltriggertype trigger = \
-                            icalproperty_get_trigger(icalcomponent_get_first_property(c2, ICAL_TRIGGER_PROPERTY));
+        // the FILTERS rules for this calendar
+        options.filters.clear();
+        for (EventFilter &filter : filters) {
+            if (filter.uri.length() == 0 || filter.uri == uri) {
+                options.filters.push_back(&filter);
+            }
+        }
 
-                        if (trigger.duration.is_neg == 1) { // alarms only occur beforehand
+        std::string &icaldata = feeds[source];
+        LocalCalendar &local = locals[source];
+        bool islocal = uri == "-" || uri.find("file://") == 0;
 
-                            // how far in advance is the alarm? we only work in minutes
-                            int advance = (trigger.duration.weeks * 7 * 86400 + \
-                                           trigger.duration.days * 86400 + \
-                                           trigger.duration.hours * 3600 + \
-                                           trigger.duration.minutes * 60 + 
-                                           trigger.duration.seconds) / 60;
-                            if (advance < shortest_alarm) {
-                                shortest_alarm = advance;
-                            }
-                        }
-                    } // c2
 
-                    if (shortest_alarm != 9999989) {
-                        std::cout << "    Alarm: " << shortest_alarm << " minutes before" << std::endl;
-                        appointment.alarm              = 1;
-                        appointment.advance            = shortest_alarm;
-                        appointment.advanceUnits       = advMinutes;
-                    }
+        /** parse calendar using libical **/
 
-                } // numalarms
-                else if (uidmatched == -1 || isarecurrence) {
-                    // more initialisation
-                    appointment.alarm              = 0;
-                    // we can't store the alarm if it's not enabled so just dummy values here
-                    appointment.advance            = 0;
-                    appointment.advanceUnits       = advMinutes;
-                }
+        ALLOC_STAGE(Parse);
+        std::cout << "    ==> Parsing calendar <==" << std::endl << std::flush;
 
+        // ical specifies components, properties, values, and parameters and I think there's
+        // a bit of a metaphor relating that to HTML, with COMPONENTS corresponding to an
+        // opening BEGIN tag which contains PROPERTY tags that then have VALUES (the main
+        // thing in that tag, and then PARAMETERS which are kind of like HTML attributes,
+        // adding extra information about the PARAMETER
 
-                /* repat stuff, repeat stuff */
-
-                // RRULE repeating sets
-                // EXDATE dates in the set skipped, stored as a tm struct with year/month/day only
-                // RDATE one off of repeating events that were moved, they appear as a normal event so ignore?
-                // RECURRENCE-ID similar except they have the same UID so shouldn't be merged
-
-                // https://libical.github.io/libical/apidocs/icalrecur_8h.html
-                // https://libical.github.io/libical/apidocs/structicalrecurrencetype.html
-                // https://freetools.textmagic.com/rrule-generator
-                // https://icalendar.org/validator.html
-                // https://icalendar.org/iCalendar-RFC-5545/3-3-10-recurrence-rule.html
-
-                // ical to pilot-link mapping
-                // X INTERVAL => repeatFrequency
-                // X UNTIL => repeatEnd, repeatForever
-                // X COUNT => repeatEnd
-                // X WKST => repeatWeekstart
-                // X BYMONTHDAY => repeatMonthlyByDay
-                // X BYDAY => repeatDays
-                // X FREQ => repeatType, repeatDay (montly), repeatDays (weekly)
-                // X EXDATE => exception, exceptions
-
-                // for final repetition checks, need to test COUNT, EXDATE, RECURRENCE-ID thoroughly
-                //     for each daily, weekly, monthly, yearly
-                //     repeat forever, repeat until, repeat count
-                //     exclude or move three
-                // can also check against recur.txt from libical test-data
-
-                // declare some saine defaults to start with
-                if (uidmatched == -1 || isarecurrence) { // will already have been set if it's uidmatched
-                    appointment.repeatType         = repeatNone;
-                    appointment.repeatForever      = 0;
-                    appointment.repeatEnd.tm_year  = 0;
-                    appointment.repeatEnd.tm_mon   = 0;
-                    appointment.repeatEnd.tm_mday  = 0;
-                    appointment.repeatEnd.tm_wday  = 0;
-                    appointment.repeatFrequency    = 0;
-                    appointment.repeatWeekstart    = 1; // 0-6 Sunday to Saturday, ical default is Monday so 1
-                    for (int i = 0; i < 7; i++) appointment.repeatDays[i] = 0;
-//                    appointment.repeatDay          = 0;
-                    appointment.exceptions         = 0;
-                    appointment.exception          = nullptr; // this is an array, yikes
+        // https://github.com/libical/libical/blob/master/doc/UsingLibical.md
+        // https://libical.github.io/libical/apidocs/icalcomponent_8h.html
+        // https://libical.github.io/libical/apidocs/icalproperty_8h.html
+        // https://libical.github.io/libical/apidocs/icalparameter_8h.html
+        // https://libical.github.io/libical/apidocs/icaltime_8h.html
+        // https://libical.github.io/libical/apidocs/structicaltimetype.html
+        
+        // leave out events that can't be in the sync window before libical has to build them
+        int prefiltered = 0;
+        if (prefilter) {
+            std::string filtered;
+            if (islocal && local.map != nullptr) {
+                prefiltered = FilterCalendar(std::string_view(local.map, local.length), windowstart, windowend, filtered);
+                if (prefiltered > 0) {
+                    CloseLocalCalendar(local);
+                    islocal = false; // parse the filtered copy instead
                 }
+            }
+            else if (!islocal) {
+                prefiltered = FilterCalendar(icaldata, windowstart, windowend, filtered);
+            }
+            if (prefiltered > 0) {
+                icaldata.swap(filtered);
+                std::cout << "    Skipped " << prefiltered << " events outside of the sync window" << std::endl << std::flush;
+            }
+        }
 
-                // this assumes there's only ever one RRULE property (palm can only support one anyway)
-                icalproperty *rrule = icalcomponent_get_first_property(c, ICAL_RRULE_PROPERTY);
-                if (rrule != nullptr) {
-
-                    icalrecurrencetype recur = icalproperty_get_rrule(rrule);
-                    std::cout << "    Recurrence: " << icalrecurrencetype_as_string(&recur) << std::endl;
-
-                    // we're assuming UNTIL and COUNT are mutually exclusive
-                    if (recur.until.year != 0) {
-
-                        // there's an until date, use that
-                        time_t until_time_t = icaltime_as_timet_with_zone(recur.until, icaltime_get_timezone(recur.until));
-                        appointment.repeatEnd = *gmtime(&until_time_t); // dereference to avoid subsequent calls overwriting
-                        timegm(&appointment.repeatEnd); // needed?
-                        appointment.repeatEnd.tm_hour = 23; // as below
-                        appointment.repeatEnd.tm_min = 59;
-                        appointment.repeatEnd.tm_sec = 59;
-                    }
-                    else if (recur.count == 0) {
-
-                        // no until date, for the moment assume repeating forever
-                        appointment.repeatForever = 1;
-                    }
-                    else {
-
-                        //  we'll have to figure out what repeatEnd should be based on count, but this depends on frequency...
-                        appointment.repeatEnd = appointment.begin; // this should already be UTC
-                        // we add count * freq, but palm os ends on the day specified
-                        // end last moment of the day before (we'll have to subtract that day for them later...)
-                        appointment.repeatEnd.tm_hour = 23;
-                        appointment.repeatEnd.tm_min = 59;
-                        appointment.repeatEnd.tm_sec = 59;
-                    }
+        // parse the string into a series of components to iterate through
+        icalcomponent* components;
+        if (islocal) {
+            components = ParseLocalCalendar(local);
+            CloseLocalCalendar(local);
+        }
+        else {
+            components = icalparser_parse_string(icaldata.c_str());
+            std::string().swap(icaldata); // the raw data isn't needed once parsed
+        }
 
-                    appointment.repeatFrequency = recur.interval < 1 ? 1 : recur.interval; // 1 or INTERVAL
+        // remove errors (which also includes empty descriptions, locations, and the like) 
+        icalcomponent_strip_errors(components);
 
-                    // palm looks a bit different than libical here with the 1 being monday as opposed to 2 (ICAL_MONDAY_WEEKDAY)
-                    appointment.repeatWeekstart = weekday2int(recur.week_start);
+        // if there is some valid ical data to work through
+        if (components != nullptr) {
 
-                    // palm doesn't support anything less than daily
-                    UNSUPPORTED_ICAL(by_second, BYSECOND)
-                    UNSUPPORTED_ICAL(by_minute, BYMINUTE)
-                    UNSUPPORTED_ICAL(by_hour, BYHOUR)
+            std::cout << "    Calendar parsed successfully" << std::endl << std::endl << std::flush;
 
-                    icalrecurrencetype_frequency freq = recur.freq;
-                    if (freq == ICAL_NO_RECURRENCE || 
-                            freq == ICAL_SECONDLY_RECURRENCE || 
-                            freq == ICAL_MINUTELY_RECURRENCE || 
-                            freq == ICAL_HOURLY_RECURRENCE) {
+            ALLOC_STAGE(Convert);
 
-                        // palm doesn't support anything less than daily, so no repeating
-                        appointment.repeatType = repeatNone;
-                        failed = true;
-                        std::cout << "        WARNING unsupported frequency, won't copy!" << std::endl;
-                    }
-                    else if (freq == ICAL_DAILY_RECURRENCE) {
+            // we're only interested in calendar events, gather them up so they can be converted in parallel
+            std::vector<icalcomponent*> events;
+            for(icalcomponent *c = icalcomponent_get_first_component(components, ICAL_VEVENT_COMPONENT); c != 0;
+                    c = icalcomponent_get_next_component(components, ICAL_VEVENT_COMPONENT)) {
+                events.push_back(c);
+            }
 
-                        std::cout << "    Repeating daily" << std::endl;
-                        appointment.repeatType = repeatDaily;
+            // each event only touches its own part of the parsed calendar, but looking up a TZID sorts the
+            // calendar's VTIMEZONEs (and loads libical's builtin ones) the first time, so do that beforehand
+            icalcomponent_get_timezone(components, "UTC");
+            icaltimezone_get_builtin_timezone("UTC");
 
-                        UNSUPPORTED_ICAL(by_month, BYMONTH)
+            // the times in an event depend on the calendar's VTIMEZONEs as well as the event itself
+            cache.seed = cacheseed;
+            for(icalcomponent *c = icalcomponent_get_first_component(components, ICAL_VTIMEZONE_COMPONENT); c != 0;
+                    c = icalcomponent_get_next_component(components, ICAL_VTIMEZONE_COMPONENT)) {
+                cache.seed = HashComponent(c, cache.seed);
+            }
 
-                        if (!appointment.repeatForever && recur.count != 0) {
-                            appointment.repeatEnd.tm_mday += recur.count - 1;
-                            timegm(&appointment.repeatEnd);
-                        }
+            // all in one go, or when pipelined, a chunk at a time so that the events finished with can be
+            // written while the next chunk is converted
+            std::vector<ConvertedEvent> converted(events.size());
+            int chunk = pipelined ? PIPELINE_CHUNK : std::max((int)events.size(), 1);
+            auto convertchunk = [&](int from) {
+                ParallelFor(std::min(chunk, (int)events.size() - from), threads, [&](int i) {
+                    converted[from + i] = ConvertEvent(events[from + i], options, cache);
+                });
+            };
+
+            // merge the converted events in the order they appear in the calendar, so the result is the
+            // same as if they'd been converted one after another
+            int cachehits = 0;
+            for (int e = 0; e < converted.size(); e++) {
+                if (e % chunk == 0) {
+                    if (pipelined) {
+                        queuefinished(ready);
+                        ready.clear();
                     }
-                    else if (freq == ICAL_WEEKLY_RECURRENCE) {
-
-                        std::cout << "    Repeating weekly" << std::endl;
-                        appointment.repeatType = repeatWeekly; // repeatDays from BYDAY
-
-                        // need to loop as there might be more than one day..?
-                        for (int i = 0; recur.by_day[i] != ICAL_RECURRENCE_ARRAY_MAX; i++) {
-                            int day = weekday2int(icalrecurrencetype_day_day_of_week(recur.by_day[i]));
-                            appointment.repeatDays[day] = 1;
-                            std::cout << "        Repeating day " << day << std::endl;
-                        }
+                    convertchunk(e);
+                }
+                ConvertedEvent &event = converted[e];
 
-                        // check to make sure some repeat days are selected, if not, repeat on all days
-                        int numrepeatdays = 0;
-                        for (int i = 0; i < 7; i++) {
-                            numrepeatdays += appointment.repeatDays[i];
-                        }
-                        if (numrepeatdays == 0) {
-                            std::cout << "        Repeating all days (assumed)" << std::endl;
-                            for (int i = 0; i < 7; i++) {
-                                appointment.repeatDays[i] = 1;
-                            }
-//                            recur.count = recur.count * 7; // recur.count is otherwise days?
-                        }
+                cachehits += event.cached;
+                if (cache.enabled && !event.filtered) {
+                    cacheentries.emplace_back(event.hash, std::move(event.packed));
+                }
 
-                        // convert repeat count to repeat end date
-                        if (!appointment.repeatForever && recur.count != 0) {
-                            // the logic here is tricky! in effect we need to step forwards from the start date
-                            // counting days it happens ignoring says not selected to work out end date
-
-                            // break out when repeats exceeds the recurrence count
-                            int atday = 0; // count how many days that takes
-                            for (int i = appointment.repeatEnd.tm_wday, repeats = 0; repeats < recur.count; i++, atday++) {
-
-                                // only count days when the event occurs towards repeats
-                                if (appointment.repeatDays[i]) {
-                                    repeats++;
-                                }
-                                
-                                // for looping through days of the week
-                                if (i == 6) {
-                                    i = -1; // at the end of the loop ++ brings it back to 0?
-                                }
-                            }
+                std::cout << event.log;
+                Appointment &appointment = event.appointment;
+                std::vector<Appointment> &instances = event.instances;
+                std::string &uid = event.uid;
+                bool isarecurrence = event.isarecurrence;
+                failed = event.failed;
 
-                            appointment.repeatEnd.tm_mday += atday;
-                            appointment.repeatEnd.tm_mday--;
-                            timegm(&appointment.repeatEnd);
+                int uidmatched = -1;
+                if (uid != "") {
+                    auto match = uidindex.find(uid);
+                    if (match != uidindex.end()) {
+                        std::cout << "        Previous UID match" << std::endl;
+                        uidmatched = match->second;
+                        if (uidmatched < queued.size() && queued[uidmatched]) {
+                            // shouldn't happen, the UIDs were counted to stop it
+                            std::cerr << "    WARNING an event with this UID has already been written" << std::endl;
                         }
                     }
-                    else if (freq == ICAL_MONTHLY_RECURRENCE) {
-
-                        std::cout << "    Repeating montly" << std::endl;
-                        // events usually only repeat on one day of the month, so just check the 0th index
-                        if (recur.by_month_day[0] != ICAL_RECURRENCE_ARRAY_MAX) { // BYMONTHDAY
-
-                            // nothing extra to set, palm will just assume it's the date of the start
-                            appointment.repeatType = repeatMonthlyByDate;
-                            // day of the month in by day repeat - this is done in pilot-datebook, but doesn't seem needed based on pi-datebook.h
-                            appointment.repeatDay = (DayOfMonthType)recur.by_month_day[0]; 
-                            std::cout << "        Repeating on " << appointment.begin.tm_mday << std::endl;
+                }
 
-                            UNSUPPORTED_ICAL1(by_month_day, BYMONTHDAY)
-                        }
-                        else { // BYDAY   
-               
-                            // should only ever be the first day as monthly things can't occur more than once a month
-                            if (recur.by_day[0] != ICAL_RECURRENCE_ARRAY_MAX) {
-                                int week = icalrecurrencetype_day_position(recur.by_day[0]);
-                                if (week <= 0) {
-                                    // all days of the month (0) or counting backwards from end of month
-                                    // can't use macro here because some BYDAY are supported
-                                    failed = true;
-                                    std::cout << "        WARNING unsupported BYDAY, won't copy!" << std::endl;
-                                }
-                                else {
-                                    int day = weekday2int(icalrecurrencetype_day_day_of_week(recur.by_day[0]));
-
-                                    // not ideal, but I don't expect the DayOfMonthType enum to change anytime soon
-                                    appointment.repeatDay = (DayOfMonthType)((week - 1)*7 + day);
-
-                                    std::cout << "        Repeating the " << day << " of week " << week <<
-                                        " (enum " << appointment.repeatDay << " " << DayOfMonthString[appointment.repeatDay] << ")" << std::endl;
-
-                                    appointment.repeatType = repeatMonthlyByDay;
-                                }
-                            }
-                            else {
-                                std::cout << "        WARNING unexpected repeat???" << std::endl;
+                if (event.filtered) {
+                    // a filtered out repeat (e.g., one cancelled) shouldn't appear as part of its parent either,
+                    // and an event filtered out when it's changed means the earlier copy shouldn't be copied
+                    if (uidmatched != -1 && isarecurrence) {
+                        AddException(Appointments[uidmatched], UTCTime(event.recurrenceid));
+                        for (int i : expanded[uidmatched]) {
+                            if (timegm(&Appointments[i].begin) == event.recurrenceid) {
+                                docopy[i] = false;
                             }
                         }
-
-                        if (!appointment.repeatForever && recur.count != 0) {
-                            appointment.repeatEnd.tm_mon += recur.count;
-                            appointment.repeatEnd.tm_mday--;
-                            timegm(&appointment.repeatEnd);
-                        }
                     }
-                    else if (freq == ICAL_YEARLY_RECURRENCE) {
-                        std::cout << "    Repeating yearly" << std::endl;
-                        appointment.repeatType = repeatYearly;
-
-                        UNSUPPORTED_ICAL(by_day, BYDAY)
-                        UNSUPPORTED_ICAL(by_month, BYMONTH)
-                        UNSUPPORTED_ICAL(by_year_day, BYYEARDAY)  
-                        UNSUPPORTED_ICAL(by_week_no, BYWEEKNO)                    
-
-                        if (!appointment.repeatForever && recur.count != 0) {
-                            appointment.repeatEnd.tm_year += recur.count;
-                            appointment.repeatEnd.tm_mday--;
-                            timegm(&appointment.repeatEnd);
+                    else if (uidmatched != -1) {
+                        docopy[uidmatched] = false;
+                        for (int i : expanded[uidmatched]) {
+                            docopy[i] = false;
                         }
                     }
-                    else {
-                        std::cout << "    Unknown repeat frequency" << std::endl;
+                    std::cout << "    WARNING won't sync" << std::endl << std::endl;
+                    continue;
+                }
+
+                if (uidmatched != -1 && !isarecurrence) {
+                    // if this uid exists twice, assume the later one in the file is newer and overwrite any properties specified
+                    // it can only be allowed to match a previous UID if there's not a RECURRENCE-ID
+                    Appointment &previous = Appointments[uidmatched];
+                    if (!event.hasdescription) {
+                        appointment.description = previous.description;
                     }
-                    if (!appointment.repeatForever) {
-                        std::cout << "        Until " << asctime(&appointment.repeatEnd);
+                    if (!event.hasnote) {
+                        appointment.note = previous.note;
                     }
-
-
-                    /* argh exceptions */
-
-                    appointment.exceptions = icalcomponent_count_properties(c, ICAL_EXDATE_PROPERTY);
-                    if (appointment.exceptions != 0) {
-                        std::cout << "    There are " << appointment.exceptions << " exceptions" << std::endl;
+                    if (!event.hasalarm) {
+                        appointment.alarm = previous.alarm;
+                        appointment.advance = previous.advance;
+                        appointment.advanceUnits = previous.advanceUnits;
                     }
-
-                    appointment.exception = (tm*)malloc(appointment.exceptions * sizeof(tm)); // this should be freed by free_Appointment later
-
-                    int exceptionat = 0;
-                    for(icalproperty *exdatep = icalcomponent_get_first_property(c, ICAL_EXDATE_PROPERTY); exdatep != 0;
-                            exdatep = icalcomponent_get_next_property(c, ICAL_EXDATE_PROPERTY), exceptionat++) {
-
-                        icaltimetype exdate = icalproperty_get_exdate(exdatep);
-                        time_t exdate_time_t = icaltime_as_timet_with_zone(exdate, icaltime_get_timezone(exdate));
-
-                        appointment.exception[exceptionat] = *gmtime(&exdate_time_t); // dereference to avoid subsequent calls overwriting
-                        timegm(&appointment.exception[exceptionat]); // localtime to UTC
-                        std::cout << "        Excluding " << asctime(&appointment.exception[exceptionat]);
-                    } // for exdatep
-                } // rrule
+                    if (!event.hasrrule) {
+                        appointment.repeatType = previous.repeatType;
+                        appointment.repeatForever = previous.repeatForever;
+                        appointment.repeatEnd = previous.repeatEnd;
+                        appointment.repeatFrequency = previous.repeatFrequency;
+                        appointment.repeatWeekstart = previous.repeatWeekstart;
+                        for (int i = 0; i < 7; i++) appointment.repeatDays[i] = previous.repeatDays[i];
+                        appointment.repeatDay = previous.repeatDay;
+                        appointment.exceptions = previous.exceptions;
+                        appointment.exception = previous.exception;
+                    }
+                }
 
                 if (isarecurrence && uidmatched != -1) { 
                     // some things to do if an event is a recurrence
@@ -858,20 +1581,15 @@ int main(int argc, char **argv) {
                     // recurrence events are moved events from a repeating set, but ical doesn't add an exdate for them
                     // we don't want the moved event to appear so exclude it from the parent event based on UID
                     // i.e., if the event is a recurrence attached to another event, that other event needs an exclusion
+                    AddException(Appointments[uidmatched], appointment.begin);
 
-                    // new array at new size - argh, array resizing
-                    Appointments[uidmatched].exceptions++;
-                    tm *newexception = (tm*)malloc(Appointments[uidmatched].exceptions * sizeof(tm));
-
-                    // copy over existing exceptions into new array
-                    for (int i = 0; i < Appointments[uidmatched].exceptions-1; i++) {
-                        newexception[i] = Appointments[uidmatched].exception[i];
+                    // if the parent was expanded into individual events, the moved one shouldn't be copied either
+                    for (int i : expanded[uidmatched]) {
+                        if (timegm(&Appointments[i].begin) == event.recurrenceid) {
+                            docopy[i] = false;
+                            std::cout << "    Removing moved event from expanded events" << std::endl;
+                        }
                     }
-                    newexception[Appointments[uidmatched].exceptions-1] = appointment.begin;
-
-                    // cuckoo time
-                    free(Appointments[uidmatched].exception); // clear out old egg
-                    Appointments[uidmatched].exception = newexception; // put new egg in nest
 
                     // we could copy parent note/summary if there is one and the appointment doesn't have its own?
                 }
@@ -880,14 +1598,29 @@ int main(int argc, char **argv) {
                 /* phew, done with this event */
 
                 // store the Appointment, either overwriting itself in the list of appointments or adding a new one
+                int stored = uidmatched;
                 if (uidmatched != -1 && !isarecurrence) {
                     Appointments[uidmatched] = appointment;
                     std::cout << "    Merging" << std::endl;
+
+                    // any events expanded from the earlier copy are replaced by this one's
+                    for (int i : expanded[uidmatched]) {
+                        docopy[i] = false;
+                    }
+                    expanded[uidmatched].clear();
+                    if (instances.size() > 0) {
+                        docopy[uidmatched] = false;
+                    }
                 }
                 else {
+                    stored = Appointments.size();
                     Appointments.push_back(appointment);
+                    sources.push_back(source);
                     if (!isarecurrence) {
                         uids.push_back(uid);
+                        if (uid != "") {
+                            uidindex.emplace(uid, stored);
+                        }
                     }
                     else {
                         // don't store the uid of a recurrence so that all exclusions get added to the correct one
@@ -913,6 +1646,12 @@ int main(int argc, char **argv) {
                         std::cout << "    Older than " << previousdays << " days, ignoring" << std::endl;
                     }
 
+                    // skip if it's newer than FUTUREDAYS (repeating events will already have been clipped)
+                    if (windowend > 0 && timegm(&appointment.begin) > windowend) {
+                        failed = true; // gets put in docopy
+                        std::cout << "    Later than " << futuredays << " days from now, ignoring" << std::endl;
+                    }
+
                     docopy.push_back(!failed);
                     if (docopy.back()) { // should get last element
                         std::cout << "    Stored for sync" << std::endl << std::endl;
@@ -922,100 +1661,312 @@ int main(int argc, char **argv) {
                     }
                 }
 
-            } // for c
+                // the expanded events are stored after the repeating event they came from
+                for (Appointment &instance : instances) {
+                    Appointments.push_back(instance);
+                    uids.push_back("");
+                    docopy.push_back(true);
+                    expanded[stored].push_back(Appointments.size() - 1);
+                    sources.push_back(source);
+                }
+                if (instances.size() > 0) {
+                    std::cout << "    Stored " << instances.size() << " expanded events for sync" << std::endl << std::endl;
+                }
+
+                // when pipelined, an event (and what was expanded from it) is finished with if no other event
+                // can change it, those that can are queued once everything's converted
+                auto count = uidcounts.find(uid);
+                if (pipelined && (isarecurrence || uid == "" || (count != uidcounts.end() && count->second == 1))) {
+                    ready.push_back(stored);
+                    for (int i = Appointments.size() - instances.size(); i < Appointments.size(); i++) {
+                        ready.push_back(i);
+                    }
+                }
+
+            } // for event
+            if (pipelined) {
+                queuefinished(ready);
+                ready.clear();
+            }
+            if (cache.enabled) {
+                std::cout << "    " << cachehits << " of " << converted.size() << " events were already in the conversion cache"
+                    << std::endl << std::endl;
+            }
 //            if (c != nullptr) icalcomponent_free(c);
             icalcomponent_free(components); // already not null by definition inside this if statement
         } // if components
 
     } // for alluris
 
+    ALLOC_STAGE(Prepare);
 
-    /* adjust time zone to specified timezone */
+    // always cleanup!
+    curl_easy_cleanup(curl);
+    curl_global_cleanup();
+
+    // replace the conversion cache with this run's events, so events no longer in the calendars drop out
+    if (cache.enabled) {
+        CloseConversionCache(cache);
+        if (!prepared && !SaveConversionCache(convertcache, cacheentries)) {
+            std::cerr << "    WARNING unable to write conversion cache " << convertcache << ": " << strerror(errno) << std::endl;
+        }
+        std::vector<std::pair<uint64_t, std::string>>().swap(cacheentries);
+    }
 
-    if (timezone != "UTC") {
+    // the events that could have been changed by later ones are finished with now, and then that's everything
+    if (pipelined) {
+        std::vector<int> rest;
+        for (int i = 0; i < Appointments.size(); i++) {
+            rest.push_back(i);
+        }
+        queuefinished(rest);
+        pipelinequeue.push(PipelineRecord());
 
-        std::cout << "    ==> Timezone Conversion <==" << std::endl << std::flush;
+        if (pipelinefolded > 0) {
+            std::cout << "    Folded " << pipelinefolded << " events duplicated across calendars" << std::endl;
+        }
+        if (pipelinepruned > 0) {
+            std::cout << "    Removed " << pipelinepruned << " exceptions outside the sync window" << std::endl;
+        }
+        if (pipelinetruncated > 0) {
+            std::cout << "    Shortened " << pipelinetruncated << " notes to fit" << std::endl;
+        }
+        if (pipelinedropped > 0) {
+            std::cout << "    WARNING " << pipelinedropped << " events won't fit on the Palm and won't be copied" << std::endl;
+        }
+        std::cout << "    Queued " << pipelinequeued << " records to write" << std::endl << std::endl << std::flush;
+    }
 
-        // mktime apparently reads off the TZ environment variable
-        // per https://rl.se/convert-utc-to-local-time
-        char *tz = getenv("TZ");
-        timezone = "TZ=" + timezone;
-        putenv((char*)timezone.c_str());
 
-        for (int i = 0; i < Appointments.size(); i++) {
+    /* remove the same event appearing in more than one calendar */
 
-            // no timezone adjustment needed for all day events
-            if (Appointments[i].event) {
+    // e.g., a meeting on both a personal and a team calendar will have different UIDs,
+    // so match on the summary, start, end, and repeat instead, keeping the copy from the
+    // calendar listed first
+    // (a prepared calendar already had all of this done to it, and a pipelined sync does it as events are queued)
+    if (deduplicate && alluris.size() > 1 && !prepared && !pipelined) {
+        std::unordered_map<std::string, int> seen; // content key to index of the copy being kept
+        int folded = 0;
+        for (int i = 0; i < Appointments.size(); i++) {
+            if (!docopy[i]) {
                 continue;
             }
+            auto match = seen.emplace(DuplicateKey(Appointments[i]), i);
+            if (!match.second && sources[match.first->second] != sources[i]) {
+                docopy[i] = false;
+                folded++;
+            }
+        }
+        if (folded > 0) {
+            std::cout << "    Folded " << folded << " events duplicated across calendars" << std::endl << std::endl;
+        }
+    }
+
+
+    /* drop exceptions from outside the sync window */
+
+    // moved events add exceptions to their parent after it's been clipped, so this is done once everything is read
+    int prunedexceptions = 0;
+    for (int i = 0; i < Appointments.size() && !prepared && !pipelined; i++) {
+        if (docopy[i]) {
+            prunedexceptions += PruneExceptions(Appointments[i]);
+        }
+    }
+    if (prunedexceptions > 0) {
+        std::cout << "    Removed " << prunedexceptions << " exceptions outside the sync window" << std::endl << std::endl;
+    }
 
-            time_t stamp;  
 
-            // timegm takes the tm struct and ignores TZ converting to time_t (assuming UTC, which it is)
-            // localtime take time_t and converts to a tm struct taking TZ into account
-            stamp = timegm(&Appointments[i].begin);
-            Appointments[i].begin = *localtime(&stamp);
+    /* adjust time zone to specified timezone */
 
-            stamp = timegm(&Appointments[i].end);
-            Appointments[i].end = *localtime(&stamp);
+    // (a pipelined sync converted each event as it was queued)
+    if (timezone != "UTC" && !prepared && !pipelined) {
 
-            // std::cout << "    Summary: " << Appointments[i].description << std::endl;
-            // std::cout << "    Start " << Appointments[i].begin.tm_zone << ": " << asctime(&Appointments[i].begin);
-            // std::cout << "    End " << Appointments[i].end.tm_zone << ": " << asctime(&Appointments[i].end) << std::endl;
+        std::cout << "    ==> Timezone Conversion <==" << std::endl << std::flush;
 
-            // repeat end? don't need to as it always is 23:59:59 on the day
-            // loop exceptions? don't need to because also only a day
+        std::vector<int> all(Appointments.size());
+        for (int i = 0; i < Appointments.size(); i++) {
+            all[i] = i;
         }
+        ConvertTimezone(Appointments, all, timezone);
+
+        std::cout << "    Converted to " << timezone << std::endl << std::endl;
+    }
+
+
+    /* plan what the sync will do */
 
-        //put env back the way it was?
-        if (tz != nullptr) {
-            timezone = "TZ=" + std::string(tz);
-            putenv((char*)timezone.c_str());
+    // from what the last sync wrote and how fast the link was then, so that a big sync can be seen coming
+    // (e.g., by running with DOHOTSYNC=false or -P) before the palm's battery or timeout is put to the test
+    SyncPlan plan;
+    LinkSpeed linkspeed;
+    std::string planfile, lastplanfile, linkfile;
+    // (a pipelined sync is already writing, so it just keeps what it's written for the next plan)
+    if (!readonly) {
+        if (statedir.length() > 0) {
+            planfile = PlanFile(statedir, profileuser);
+            lastplanfile = (std::filesystem::path(statedir) / "written-last").string();
+            linkfile = (std::filesystem::path(statedir) / "link").string();
+            LoadLinkSpeed(linkfile, linkspeed);
         }
-        else {
-            putenv((char*)"TZ=");
+    }
+    if (!readonly && !pipelined) {
+        std::cout << "    ==> Sync plan <==" << std::endl;
+        std::vector<std::pair<uint64_t, uint64_t>> previous;
+        if (statedir.length() > 0) {
+            // without a palm or -P there's no user name, so plan against whichever palm was synced last
+            if (profileuser.length() == 0) {
+                std::cout << "    Planning for the last Palm synced (use -P for a particular one)" << std::endl;
+            }
+            LoadWritten(profileuser.length() > 0 ? planfile : lastplanfile, previous);
+        }
+        plan = PlanSync(Appointments, docopy, sources, alluris, previous, overwrite, onlynew, categories, !options.transcode);
+        PrintPlan(plan, linkspeed);
+        std::cout << std::endl << std::flush;
+
+        // keep what was made for this palm so it can be written as it is when it connects
+        if (!dohotsync && preparedfile.length() > 0) {
+            if (SavePrepared(preparedfile, settingskey, contentkey, fetched, plan.packed, sources)) {
+                std::cout << "    Prepared " << plan.records.size() << " events for " << profileuser << std::endl << std::endl;
+            }
+            else {
+                std::cerr << "    WARNING unable to save the prepared calendar: " << strerror(errno) << std::endl << std::endl;
+            }
         }
-
-        std::cout << "    Converted to " << timezone.substr(3) << std::endl << std::endl;
     }
 
 
     /** palm pilot communication part 2 **/
 
+    ALLOC_STAGE(HotSync);
+
     if (!dohotsync) {
         return EXIT_SUCCESS;
     }
 
     std::cout << "    ==> Downloading to Palm <==" << std::endl << std::flush;
 
-    // open the datebook and store a handle to it in db
-    int db;
-    if (dlp_OpenDB(sd, 0, 0x80 | 0x40, "DatebookDB", &db) < 0) {
-        std::cerr << "    ERROR unable to open DatebookDB on Palm" << std::endl;
-        // (char*) is a little unsafe, but function does not edit the string
-        dlp_AddSyncLogEntry(sd, (char*)"Unable to open DatebookDB.\n"); // log on palm
-        pi_close_fixed(sd, port);
+
+    /* skip the whole thing if nothing's changed */
+
+    // if the records to be written are the same as last time, and the datebook hasn't been touched since
+    // (its modification number goes up with any change, on the palm or by another sync), there's nothing to do
+    // (a pipelined sync has already checked)
+    if (statedir.length() > 0 && !readonly && !pipelined) {
+        syncstatefile = DeviceFile(statedir, "sync", User);
+
+        char writesettings[64];
+        snprintf(writesettings, sizeof(writesettings), "%d|%d|%d|%d", overwrite, onlynew, categories, maxbytes);
+        syncstate.fingerprint = Hash64(writesettings);
+        for (std::string &uri : alluris) {
+            syncstate.fingerprint = Hash64(uri, syncstate.fingerprint);
+        }
+        for (const auto &[calendar, record] : plan.records) { // the packed records, already hashed for the plan
+            syncstate.fingerprint = Hash64(std::string_view((char*)&record, sizeof(record)), syncstate.fingerprint + calendar);
+        }
+
+        if (AlreadySynced(sd, syncstatefile, User, syncstate.fingerprint)) {
+            std::cout << "    Nothing has changed since the last sync, skipping" << std::endl << std::endl << std::flush;
+            DLP(dlp_AddSyncLogEntry(sd, (char*)"Appointments already up to date.\n"), 0, 0); // log on palm
+            if (pi_close_fixed(sd, port, closetimeout) < 0) {
+                return EXIT_FAILURE;
+            }
+            return EXIT_SUCCESS;
+        }
+
+        // a sync that doesn't finish mustn't leave the last one's behind
+        remove(syncstatefile.c_str());
+    }
+
+    // open the datebook and store a handle to it in db (a pipelined sync already has)
+    if (!pipelined && (db = OpenDatebook(sd)) < 0) {
+        pi_close_fixed(sd, port, closetimeout);
         return EXIT_FAILURE;
     }
-    else {
-        std::cout << "    DatebookDB opened." << std::endl << std::flush;
+
+
+    /* a category for each calendar */
+
+    // so that each calendar can be replaced on its own, leaving the others (and events made on the palm) alone
+    std::vector<std::string> categorynames = CategoryNames(alluris);
+    std::vector<int> categoryof(alluris.size(), 0); // the index of each calendar's category, 0 is Unfiled
+    if (categories && !readonly) {
+        pi_buffer_t *appblock = pi_buffer_new(0xffff);
+        AppointmentAppInfo appinfo;
+        if (DLP(dlp_ReadAppBlock(sd, db, 0, -1, appblock), 0, appblock->used) < 0 ||
+                unpack_AppointmentAppInfo(&appinfo, appblock->data, appblock->used) < 0) {
+            std::cerr << "    WARNING unable to read the Datebook's categories, not using them" << std::endl;
+            categories = false;
+        }
+
+        bool changed = false;
+        for (int i = 0; categories && i < alluris.size(); i++) {
+            categoryof[i] = FindCategory(appinfo.category, categorynames[i], changed);
+            if (categoryof[i] < 0) {
+                std::cerr << "    WARNING no room for another category for " << categorynames[i] << ", not using them" << std::endl;
+                categories = false;
+            }
+        }
+
+        // new categories have to be written back before records can be put in them
+        if (categories && changed) {
+            std::vector<unsigned char> block(0xffff);
+            int length = pack_AppointmentAppInfo(&appinfo, block.data(), block.size());
+            if (length < 0 || DLP(dlp_WriteAppBlock(sd, db, block.data(), length), length, 0) < 0) {
+                std::cerr << "    WARNING unable to add categories to the Datebook, not using them" << std::endl;
+                categories = false;
+            }
+        }
+        pi_buffer_free(appblock);
+
+        if (categories) {
+            for (int i = 0; i < alluris.size(); i++) {
+                std::cout << "    Category " << categorynames[i] << " for " << alluris[i] << std::endl;
+            }
+        }
+        else {
+            std::fill(categoryof.begin(), categoryof.end(), 0);
+        }
+    }
+
+
+    /* pick up where an interrupted sync left off */
+
+    // only if nothing else has synced the palm since, and when overwriting, only if the datebook
+    // has just the records that were written last time (a pipelined sync has already started a new checkpoint)
+    bool resuming = false;
+    if (statedir.length() > 0 && !readonly && !pipelined) {
+        checkpointfile = DeviceFile(statedir, "checkpoint", User);
+        resuming = LoadCheckpoint(checkpointfile, checkpoint) && checkpoint.lastsync == User.lastSyncDate &&
+            checkpoint.records.size() > 0;
+        if (resuming && overwrite && categories) {
+            resuming = false; // the records are mixed in with other categories so they can't be checked
+        }
+        if (resuming && overwrite) {
+            int count = 0;
+            resuming = DLP(dlp_ReadOpenDBInfo(sd, db, &count), 0, sizeof(count)) >= 0 && count == checkpoint.records.size();
+        }
+        if (resuming) {
+            std::cout << "    Resuming an interrupted sync, " << checkpoint.records.size() << " records were already written" << std::endl;
+        }
+        else {
+            checkpoint = Checkpoint();
+        }
+        checkpoint.lastsync = User.lastSyncDate;
     }
 
 
     /* handle datebook manipulation on the palm */
 
-    // delete records if need be
-    if (overwrite && !readonly) {
+    // delete records if need be (unless they're the ones an interrupted sync already wrote)
+    // with categories, only the calendars that have changed are deleted, once they're packed
+    // (a pipelined sync deleted them before it started writing)
+    if (overwrite && !readonly && !resuming && !categories && !pipelined) {
         // delete ALL records
-        std::cout << "    Deleting existing Palm datebook..." << std::flush;
-        if (dlp_DeleteRecord(sd, db, 1, 0) < 0) {
-            std::cerr << std::endl << "    ERROR unable to delete DatebookDB records on Palm" << std::endl;
-            // (char*) is a little unsafe, but function does not edit the string
-            dlp_AddSyncLogEntry(sd, (char*)"Unable to delete DatebookDB records.\n"); // log on palm
-            pi_close_fixed(sd, port);
+        if (!DeleteDatebook(sd, db)) {
+            pi_close_fixed(sd, port, closetimeout);
             return EXIT_FAILURE;
         }
-        std::cout << " done!" << std::endl << std::flush;
     }
 
     // read existing calendar events off of palm pilot and either add ONLYNEW events or delete existing events to be refreshed/updated
@@ -1025,9 +1976,9 @@ int main(int argc, char **argv) {
 
         #define REC_MAX 10000  // we're betting no one's got more than 10k records
         recordid_t recids[REC_MAX];
-        int reccount;
+        int reccount = 0;
 
-        if (dlp_ReadRecordIDList(sd, db, 0, 0, REC_MAX, recids, &reccount) < 0) {
+        if (DLP(dlp_ReadRecordIDList(sd, db, 0, 0, REC_MAX, recids, &reccount), 0, reccount * sizeof(recordid_t)) < 0) {
             // this fails with zero records, so zero it is
             reccount = 0;
         }
@@ -1042,95 +1993,418 @@ int main(int argc, char **argv) {
         }
         std::cout << std::flush;
 
+        // records an interrupted sync wrote are already up to date
+        std::unordered_map<recordid_t, uint64_t> written;
+        if (resuming) {
+            written.insert(checkpoint.records.begin(), checkpoint.records.end());
+        }
+
         // get the existing datebook entries
         // if onlynew is set then sync only entries that don't already appear (matched by date and time)
         // otherwise overwrite those previous entries, in effect updating them
+
+        // first read all of them into one buffer, so that unpacking and matching them against the calendar
+        // (which takes a while with a lot of both) happens on other threads while the deletes go to the palm
+        std::string raw; // the records one after the other
+        std::vector<size_t> rawstart(1, 0); // where each record starts in raw, with where the last one ends at the back
+        std::vector<recordid_t> rawids;
+        pi_buffer_t *Appointment_buf = pi_buffer_new(0xffff); // store the read record
         for (int i = 0; i < reccount; i++) {
 
             int attr; // record attributes so we don't deal with deleted or archived records?
-            pi_buffer_t *Appointment_buf = pi_buffer_new(0xffff); // store the read record
-            dlp_ReadRecordById(sd, db, recids[i], Appointment_buf, 0, &attr, 0);
+            auto start = std::chrono::steady_clock::now();
+            if (DLP(dlp_ReadRecordById(sd, db, recids[i], Appointment_buf, 0, &attr, 0), 0, Appointment_buf->used) < 0) {
+                continue;
+            }
+            linkmeter.add(Appointment_buf->used, start);
 
             // records marked for deletion or archival are no longer on the palm after sync so skip as if they don't exist
             if ((attr & dlpRecAttrDeleted) || (attr & dlpRecAttrArchived)) {
-                pi_buffer_free(Appointment_buf);
                 continue;
             }
 
-            // convert the packed data to something we can manipulate
-            struct Appointment appointment;
-            unpack_Appointment(&appointment, Appointment_buf, datebook_v1);
+            raw.append((char*)Appointment_buf->data, Appointment_buf->used);
+            rawstart.push_back(raw.size());
+            rawids.push_back(recids[i]);
+        }
+        pi_buffer_free(Appointment_buf);
+
+        // the created appointments by their start time, to only compare against those that could match
+        // (worked out here as timegm would otherwise be changing them from more than one thread)
+        std::vector<time_t> ends(Appointments.size());
+        std::unordered_multimap<time_t, int> bystart;
+        for (int j = 0; j < Appointments.size(); j++) {
+            bystart.emplace(timegm(&Appointments[j].begin), j);
+            ends[j] = timegm(&Appointments[j].end);
+        }
 
-            // compare against the created appointments
-            time_t starttime = timegm(&appointment.begin);
-            time_t endtime = timegm(&appointment.end);
+        // which of the created appointments each record on the palm matches
+        struct Existing {
+            std::vector<int> matches;
+            bool alreadywritten = false; // by the sync being resumed
+        };
+        std::vector<Existing> existing(rawids.size());
 
-            for (int j = 0; j < Appointments.size(); j++) {
-                if (strcmp(appointment.description, Appointments[j].description) == 0 &&
-                        difftime(starttime, timegm(&Appointments[j].begin)) == 0  &&
-                        // palm issues end time = start time for all day events, so just check if it's an all day instead
-                        (difftime(endtime, timegm(&Appointments[j].end)) == 0 || appointment.event == 1 && Appointments[j].event == 1)) {
+        // the records whose matches have been found, handed over as each is done
+        std::mutex matchedlock;
+        std::condition_variable matchedready;
+        std::vector<int> matched;
 
-                    if (onlynew) {
+        auto match = [&](int i) {
+            std::string_view data(raw.data() + rawstart[i], rawstart[i + 1] - rawstart[i]);
+            pi_buffer_t record = {(unsigned char*)data.data(), data.length(), data.length()};
 
-                        // if the event already exists then we shouldn't copy a new one if only new events are to be copied
-                        docopy[j] = false;
-                    }
-                    else {
+            auto checkpointed = written.find(rawids[i]);
+            existing[i].alreadywritten = checkpointed != written.end() && checkpointed->second == Hash64(data);
 
-                        // if we're OK with copying existing events, we don't want loads of them to show up so delete the existing one
-                        if (!readonly) {
-                            dlp_DeleteRecord(sd, db, 0, recids[i]);
-                        }
+            // convert the packed data to something we can manipulate
+            struct Appointment appointment;
+            if (unpack_Appointment(&appointment, &record, datebook_v1) >= 0) {
+
+                // compare against the created appointments
+                time_t starttime = timegm(&appointment.begin);
+                time_t endtime = timegm(&appointment.end);
+
+                auto candidates = bystart.equal_range(starttime);
+                for (auto candidate = candidates.first; candidate != candidates.second; candidate++) {
+                    int j = candidate->second;
+                    const char *description = Appointments[j].description;
+                    if ((appointment.description != nullptr && description != nullptr ?
+                                strcmp(appointment.description, description) == 0 : appointment.description == description) &&
+                            // palm issues end time = start time for all day events, so just check if it's an all day instead
+                            (difftime(endtime, ends[j]) == 0 || (appointment.event == 1 && Appointments[j].event == 1))) {
+                        existing[i].matches.push_back(j);
                     }
-//                    break; // we expect there to be only one matching event by summary, date & time, break out
                 }
-            } // for Appointments
-            
-            // free up used resources
-            free_Appointment(&appointment);
-            pi_buffer_free(Appointment_buf);
+
+                // free up used resources
+                free_Appointment(&appointment);
+            }
+            {
+                std::lock_guard<std::mutex> lock(matchedlock);
+                matched.push_back(i);
+            }
+            matchedready.notify_one();
+        };
+        std::thread matcher([&]() {
+            ParallelFor(rawids.size(), threads, match);
+        });
+
+        // then act on the matches as they come in, in whatever order they finish (deleting one record
+        // doesn't depend on any other, so a slow one to unpack doesn't hold up the rest)
+        std::vector<int> ready;
+        for (int handled = 0; handled < rawids.size(); handled++) {
+            if (ready.empty()) {
+                std::unique_lock<std::mutex> lock(matchedlock);
+                matchedready.wait(lock, [&]() { return !matched.empty(); });
+                ready.swap(matched);
+            }
+            int i = ready.back();
+            ready.pop_back();
+
+            if (existing[i].matches.size() == 0) {
+                continue;
+            }
+            if (onlynew || existing[i].alreadywritten) {
+
+                // if the event already exists then we shouldn't copy a new one if only new events are to be copied
+                // (or if it was written by the sync being resumed)
+                for (int j : existing[i].matches) {
+                    docopy[j] = false;
+                }
+            }
+            else if (!readonly) {
+
+                // if we're OK with copying existing events, we don't want loads of them to show up so delete the existing one
+                auto start = std::chrono::steady_clock::now();
+                DLP(dlp_DeleteRecord(sd, db, 0, rawids[i]), 0, 0);
+                linkmeter.add(0, start);
+            }
         }
+        matcher.join();
         std::cout << "done!" << std::endl << std::flush;
     }
 
     // some tidying since we've been deleting things, might not do anything
-    dlp_CleanUpDatabase(sd, db);
-    dlp_ResetDBIndex(sd, db);
+    // (a pipelined sync did this before it started writing, and is still writing)
+    if (!pipelined) {
+        DLP(dlp_CleanUpDatabase(sd, db), 0, 0);
+        DLP(dlp_ResetDBIndex(sd, db), 0, 0);
+    }
 
-    // send the appointments across one by one
-    if (!readonly) {
+    // the appointments were all packed (and hashed) for the plan, so it's known how much space they need on the palm
+    std::vector<pi_buffer_t*> &packed = plan.packed;
+    std::vector<uint64_t> &hashes = plan.hashes;
+    std::string fingerprintfile;
+    std::unordered_map<std::string, uint64_t> fingerprints; // of each calendar's category, by name
+    if (!readonly && !pipelined) {
+        size_t totalbytes = 0;
+        int numrecords = 0, numtruncated = plan.truncated, numdropped = plan.dropped;
+        for (int i = 0; i < Appointments.size(); i++) {
+
+            // let go of records no longer marked for transfer (e.g., already on the palm with ONLYNEW)
+            if (packed[i] != nullptr && !docopy[i]) {
+                pi_buffer_free(packed[i]);
+                packed[i] = nullptr;
+            }
+            if (packed[i] != nullptr) {
+                totalbytes += packed[i]->used + RECORD_OVERHEAD;
+                numrecords++;
+            }
+        }
+        std::cout << "    " << numrecords << " records to write, " << totalbytes << " bytes" << std::endl;
+
+        // with categories, only replace the calendars that are different to what was last written
+        // (unchanged calendars cost nothing on the link)
+        if (overwrite && categories) {
+            std::vector<uint64_t> fingerprint(alluris.size(), Hash64(""));
+            for (int i = 0; i < Appointments.size(); i++) {
+                if (packed[i] != nullptr) {
+                    fingerprint[sources[i]] = Hash64(std::string_view((char*)&hashes[i], sizeof(hashes[i])), fingerprint[sources[i]]);
+                }
+            }
+
+            if (statedir.length() > 0) {
+                fingerprintfile = DeviceFile(statedir, "categories", User);
+                LoadFingerprints(fingerprintfile, User.lastSyncDate, fingerprints);
+            }
+
+            std::vector<bool> replace(alluris.size(), true);
+            for (int s = 0; s < alluris.size(); s++) {
+                if (!fetched[s]) {
+                    replace[s] = false; // leave whatever was there last time
+                    continue;
+                }
+                auto previous = fingerprints.find(categorynames[s]);
+                replace[s] = previous == fingerprints.end() || previous->second != fingerprint[s];
+                if (replace[s]) {
+                    fingerprints.erase(categorynames[s]);
+                }
+            }
+            // saved before deleting anything, so that if the sync is interrupted the calendars are replaced again
+            if (fingerprintfile.length() > 0) {
+                SaveFingerprints(fingerprintfile, User.lastSyncDate, fingerprints);
+            }
+
+            for (int s = 0; s < alluris.size(); s++) {
+                if (replace[s]) {
+                    std::cout << "    Replacing category " << categorynames[s] << "... " << std::flush;
+                    if (DLP(dlp_DeleteCategory(sd, db, categoryof[s]), 0, 0) < 0) {
+                        std::cerr << std::endl << "    ERROR unable to delete category " << categorynames[s] << " on Palm" << std::endl;
+                        DLP(dlp_AddSyncLogEntry(sd, (char*)"Unable to delete DatebookDB category.\n"), 0, 0); // log on palm
+                        pi_close_fixed(sd, port, closetimeout);
+                        return EXIT_FAILURE;
+                    }
+                    std::cout << "done!" << std::endl << std::flush;
+                    fingerprints[categorynames[s]] = fingerprint[s];
+                }
+                else {
+                    std::cout << "    Category " << categorynames[s] << (fetched[s] ? " is unchanged" : " left as it was") << std::endl;
+                }
+            }
+
+            // unchanged calendars are already on the palm
+            for (int i = 0; i < Appointments.size(); i++) {
+                if (packed[i] != nullptr && !replace[sources[i]]) {
+                    totalbytes -= packed[i]->used + RECORD_OVERHEAD;
+                    pi_buffer_free(packed[i]);
+                    packed[i] = nullptr;
+                    docopy[i] = false;
+                }
+            }
+        }
+
+        // when resuming with OVERWRITE, records already written don't need writing again, and any that
+        // aren't wanted any more (the calendar changed in between) are removed
+        if (resuming && overwrite) {
+            std::unordered_map<uint64_t, std::vector<recordid_t>> written; // by hash, the same event may be in twice
+            for (const auto &[id, hash] : checkpoint.records) {
+                written[hash].push_back(id);
+            }
+            checkpoint.records.clear();
+
+            int numresumed = 0, numstale = 0;
+            for (int i = 0; i < Appointments.size(); i++) {
+                if (packed[i] == nullptr) {
+                    continue;
+                }
+                uint64_t hash = hashes[i];
+                auto match = written.find(hash);
+                if (match != written.end() && match->second.size() > 0) {
+                    checkpoint.records.emplace_back(match->second.back(), hash);
+                    match->second.pop_back();
+                    totalbytes -= packed[i]->used + RECORD_OVERHEAD;
+                    pi_buffer_free(packed[i]);
+                    packed[i] = nullptr;
+                    docopy[i] = false;
+                    numresumed++;
+                }
+            }
+            for (const auto &[hash, ids] : written) {
+                for (recordid_t id : ids) {
+                    DLP(dlp_DeleteRecord(sd, db, 0, id), 0, 0);
+                    numstale++;
+                }
+            }
+            std::cout << "    " << numresumed << " records already written, " << numstale << " no longer needed were deleted" << std::endl;
+        }
+
+        // how much space is there on the palm?
+        size_t budget = SpaceForRecords(sd, maxbytes);
+
+        if (budget > 0 && totalbytes > budget) {
+            std::cout << "    WARNING calendar is larger than the " << budget << " bytes available, trimming... " << std::flush;
+
+            // the events furthest from today are the first to go
+            std::vector<int> order;
+            std::vector<time_t> distance(Appointments.size(), 0);
+            for (int i = 0; i < Appointments.size(); i++) {
+                if (packed[i] != nullptr) {
+                    order.push_back(i);
+                    distance[i] = TimeFromToday(Appointments[i], today);
+                }
+            }
+            std::stable_sort(order.begin(), order.end(), [&distance](int a, int b) { return distance[a] > distance[b]; });
+
+            // first cut notes down to a short preview
+            for (int i : order) {
+                if (totalbytes <= budget) {
+                    break;
+                }
+                size_t before = packed[i]->used;
+                if (ShortenRecord(Appointments[i], packed[i], !options.transcode)) {
+                    totalbytes -= before;
+                    hashes[i] = Hash64(std::string_view((char*)packed[i]->data, packed[i]->used));
+                    totalbytes += packed[i]->used;
+                    numtruncated++;
+                }
+            }
+
+            // then drop whole events
+            for (int i : order) {
+                if (totalbytes <= budget) {
+                    break;
+                }
+                totalbytes -= packed[i]->used + RECORD_OVERHEAD;
+                pi_buffer_free(packed[i]);
+                packed[i] = nullptr;
+                docopy[i] = false;
+                numdropped++;
+            }
+
+            std::cout << "done, " << totalbytes << " bytes" << std::endl;
+        }
+
+        if (numtruncated > 0) {
+            std::cout << "    Shortened " << numtruncated << " notes to fit" << std::endl;
+        }
+        if (numdropped > 0) {
+            std::cout << "    WARNING " << numdropped << " events won't fit on the Palm and won't be copied" << std::endl;
+        }
+        std::cout << std::flush;
+    }
+
+    // a pipelined sync just has to wait for the writer to finish
+    failed = false;
+    if (pipelined) {
         std::cout << "    Writing calendar appointments... " << std::flush;
+        writer.join();
+        failed = writefailed;
+        plan.records.swap(pipelinewritten);
+        if (!failed) {
+            std::cout << "done, " << numwritten << " records" << std::endl << std::flush;
+        }
+        else {
+            // most likely the palm is full
+            std::cerr << std::endl << "    ERROR writing appointment to Palm" << std::endl;
+            std::cerr << "    ERROR only wrote " << numwritten << " of " << numtowrite << " appointments" << std::endl << std::flush;
+        }
+    }
+    else if (!readonly) {
+        // send the appointments across one by one, nearest to today first so that if the sync doesn't
+        // finish, the events that matter most are already on the palm
+        std::vector<int> order;
+        std::vector<time_t> distance(Appointments.size(), 0);
         for (int i = 0; i < Appointments.size(); i++) {
+            if (docopy[i]) {
+                order.push_back(i);
+                distance[i] = TimeFromToday(Appointments[i], today);
+            }
+        }
+        std::stable_sort(order.begin(), order.end(), [&distance](int a, int b) { return distance[a] < distance[b]; });
+
+        // how far through writing them
+        size_t towrite = 0;
+        int numrecords = 0;
+        for (int i : order) {
+            if (docopy[i]) {
+                towrite += packed[i]->used;
+                numrecords++;
+            }
+        }
+        WriteProgress progress(numrecords, towrite, linkspeed, linkmeter);
+
+        // each record is noted down once it's written, to resume from if this sync is interrupted
+        FILE *checkpointing = nullptr;
+        if (checkpointfile.length() > 0) {
+            checkpointing = StartCheckpoint(checkpointfile, checkpoint);
+            if (checkpointing == nullptr) {
+                std::cerr << "    WARNING unable to write checkpoint " << checkpointfile << ": " << strerror(errno) << std::endl;
+            }
+        }
+
+        std::cout << "    Writing calendar appointments... " << std::flush;
+        for (int i : order) {
 
             // skip records not marked for transfer
             if (docopy[i] == false) {
                 continue;
             }
+            numtowrite++;
+            if (failed) {
+                continue; // count what didn't get written
+            }
 
-            // pack the appointment struct for copying to the palm
-            pi_buffer_t *Appointment_buf = pi_buffer_new(0xffff);
-            pack_Appointment(&Appointments[i], Appointment_buf, datebook_v1);
-            // could free here? should be fine to delete some things after the appointment is packed
-
-            // send to the palm, this will return < 0 if there's an error - might want to do check that?
-            dlp_WriteRecord(sd, db, 0, 0, 0, Appointment_buf->data, Appointment_buf->used, 0);
-            // last argument is recordid_t *newrecuid, could store that between syncs with list of ical UIDs for better record updating
-            // using PilotUser and SysInfo to identify individual palm pilots?
+            // send to the palm, this will return < 0 if there's an error
+            recordid_t id = 0;
+            auto start = std::chrono::steady_clock::now();
+            int result = DLP(dlp_WriteRecord(sd, db, 0, 0, categoryof[sources[i]], packed[i]->data, packed[i]->used, &id), packed[i]->used, 0);
+            // could also store the record ids between syncs with the list of ical UIDs for better record updating
+            if (result < 0) {
+                // most likely the palm is full, there's no point carrying on
+                std::cerr << std::endl << "    ERROR writing appointment to Palm (" << result << ")" << std::endl;
+                failed = true;
+            }
+            else {
+                numwritten++;
+                AddCheckpoint(checkpointing, id, hashes[i]);
+                linkmeter.add(packed[i]->used, start);
+                progress.written(packed[i]->used);
+            }
 
             // free up memory
-            pi_buffer_free(Appointment_buf); // might as well free each buffer after it's written
+            pi_buffer_free(packed[i]); // might as well free each buffer after it's written
+            packed[i] = nullptr;
 //            free_Appointment(&Appointments[i]); // also frees string pointers (or just let these live until quitting hopefully destroys all)
 
         }
-        std::cout << "done!" << std::endl << std::flush;
+        if (checkpointing != nullptr) {
+            fclose(checkpointing);
+        }
+        if (!failed) {
+            progress.finish();
+            std::cout << "done!" << std::endl << std::flush;
+        }
+        else {
+            std::cerr << "    ERROR only wrote " << numwritten << " of " << numtowrite << " appointments" << std::endl << std::flush;
+        }
     }
 
 
     /* wrap palm things up */
 
     // close the datebook
-    dlp_CloseDB(sd, db);
+    DLP(dlp_CloseDB(sd, db), 0, 0);
     db = -1;
     std::cout << "    DatebookDB closed." << std::endl << std::flush;
 
@@ -1138,13 +2412,44 @@ int main(int argc, char **argv) {
     User.lastSyncPC     = 0x00010000;
     User.successfulSyncDate = time(NULL);
     User.lastSyncDate     = User.successfulSyncDate;
-    dlp_WriteUserInfo(sd, &User);
+    DLP(dlp_WriteUserInfo(sd, &User), sizeof(User), 0);
+
+    // nothing to resume once everything's been written
+    if (!failed && checkpointfile.length() > 0) {
+        remove(checkpointfile.c_str());
+    }
+    // and the calendars' categories match what's been written, as of this sync
+    if (!failed && fingerprintfile.length() > 0) {
+        SaveFingerprints(fingerprintfile, User.lastSyncDate, fingerprints);
+    }
+    // and how this sync left the datebook, so the next can be skipped if nothing changes
+    DBInfo info;
+    if (!failed && syncstatefile.length() > 0 &&
+            DLP(dlp_FindDBByName(sd, 0, "DatebookDB", nullptr, nullptr, &info, nullptr), 0, sizeof(info)) >= 0) {
+        syncstate.lastsync = User.lastSyncDate;
+        syncstate.modnum = info.modnum;
+        syncstate.modified = info.modifyDate;
+        SaveSyncState(syncstatefile, syncstate);
+    }
+    // and what's now on the palm and how fast the link was, for planning the next sync
+    if (!failed && planfile.length() > 0 && (!SaveWritten(planfile, plan.records) || !SaveWritten(lastplanfile, plan.records))) {
+        std::cerr << "    WARNING unable to write " << planfile << ": " << strerror(errno) << std::endl;
+    }
+    if (linkfile.length() > 0 && linkmeter.speed().samples >= PLAN_MIN_SAMPLES) {
+        SaveLinkSpeed(linkfile, linkmeter.speed());
+    }
 
     // (char*) is a little unsafe, but function does not edit the string
-    dlp_AddSyncLogEntry(sd, (char*)"Successfully wrote Appointments to Palm.\n"); // log on palm
+    if (!failed) {
+        DLP(dlp_AddSyncLogEntry(sd, (char*)"Successfully wrote Appointments to Palm.\n"), 0, 0); // log on palm
+    }
+    else {
+        std::string message = "Only wrote " + std::to_string(numwritten) + " of " + std::to_string(numtowrite) + " Appointments to Palm.\n";
+        DLP(dlp_AddSyncLogEntry(sd, (char*)message.c_str()), 0, 0);
+    }
 
     // close the connection
-    if (pi_close_fixed(sd, port) < 0) {
+    if (pi_close_fixed(sd, port, closetimeout) < 0 || failed) {
         return EXIT_FAILURE;
     }
 
@@ -18,13 +18,52 @@
  *
  */
 
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <regex>
+#include <ostream>
+#include <sstream>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <libconfig.h++>
+#include <curl/curl.h>
 #include <libical/ical.h>
 
 // default configuration file
 #define DEFAULT_CONFIG_FILE "datebook.cfg"
 
+// exit status when closing the connection hung after the sync finished (the calendar is already on the palm)
+#define EXIT_CLOSE_HUNG 3
+
+// palm records can't be more than 64k, leave a little room for the DLP request header
+#define MAX_RECORD_SIZE (0xffff - 32)
+// memory used on the palm by each record beyond its data (memory manager chunk header and database record entry)
+#define RECORD_OVERHEAD 16
+// how much of a note is kept when notes have to be cut down to fit on the palm
+#define NOTE_PREVIEW 128
+
 // fail to exit if this config item can't be read
 #define FAIL_CFG(LABEL, VAR) if (!cfg.lookupValue(#LABEL, VAR)) { \
     std::cerr << "    ERROR with "#LABEL" setting in configuration file, failing." << std::endl; \
@@ -34,6 +73,9 @@
 #define NON_FAIL_CFG(LABEL, VAR) if (!cfg.lookupValue(#LABEL, VAR)) \
     { std::cout << "    No "#LABEL" setting, assuming " << VAR << "." << std::endl; } else { \
     std::cout << "    Config "#LABEL": " << VAR << std::endl; }
+// a profile's own value for this item, if it has one
+#define PROFILE_CFG(LABEL, VAR) if (profile->lookupValue(#LABEL, VAR)) { \
+    std::cout << "    Profile "#LABEL": " << VAR << std::endl; }
 
 // callback for having curl store output in a std::string
 // https://stackoverflow.com/questions/2329571/c-libcurl-get-output-into-a-string
@@ -49,15 +91,203 @@ size_t CurlWrite_CallbackFunc_StdString(void *contents, size_t size, size_t nmem
     return newLength;
 }
 
+// local calendars (file:// URIs or - for stdin) are handed to libical line by line
+// rather than being copied into a std::string first, files are memory mapped and stdin
+// is streamed straight from the pipe
+struct LocalCalendar {
+    FILE *stream = nullptr; // stdin
+    char *map = nullptr; // memory mapped file
+    size_t length = 0;
+    size_t at = 0; // how far through the mapped file libical has read
+};
+
+// line generator for icalparser_parse() reading from a memory mapped file, like fgets
+// libical takes care of joining up lines that don't fit into s in one go
+char* LocalCalendar_LineGen_Map(char *s, size_t size, void *d) {
+    LocalCalendar *local = (LocalCalendar*)d;
+    if (local->at >= local->length || size < 2) {
+        return nullptr;
+    }
+
+    // copy up to and including the next newline, or as much as will fit
+    size_t n = local->length - local->at;
+    if (n > size - 1) {
+        n = size - 1;
+    }
+    const char *newline = (const char*)memchr(local->map + local->at, '\n', n);
+    if (newline != nullptr) {
+        n = newline - (local->map + local->at) + 1;
+    }
+    memcpy(s, local->map + local->at, n);
+    s[n] = '\0';
+    local->at += n;
+    return s;
+}
+
+// line generator for icalparser_parse() reading from a stream (stdin)
+char* LocalCalendar_LineGen_Stream(char *s, size_t size, void *d) {
+    return fgets(s, (int)size, ((LocalCalendar*)d)->stream);
+}
+
+// open a local calendar ready for parsing, returns false if that wasn't possible
+bool OpenLocalCalendar(const std::string &uri, LocalCalendar &local) {
+    if (uri == "-") {
+        local.stream = stdin;
+        return true;
+    }
+
+    // let curl deal with the file://host/path and %20 style escapes
+    std::string path;
+    CURLU *url = curl_url();
+    char *path_c = nullptr;
+    if (url != nullptr && curl_url_set(url, CURLUPART_URL, uri.c_str(), 0) == CURLUE_OK &&
+            curl_url_get(url, CURLUPART_PATH, &path_c, CURLU_URLDECODE) == CURLUE_OK) {
+        path = path_c;
+        curl_free(path_c);
+    }
+    curl_url_cleanup(url);
+    if (path.length() == 0) {
+        std::cerr << "    ERROR unable to understand file URI " << uri << std::endl;
+        return false;
+    }
+
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        std::cerr << "    ERROR unable to open " << path << ": " << strerror(errno) << std::endl;
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+
+    local.length = st.st_size;
+    if (local.length > 0) { // can't map an empty file, but then there's nothing to read anyway
+        void *map = mmap(nullptr, local.length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            std::cerr << "    ERROR unable to map " << path << ": " << strerror(errno) << std::endl;
+            close(fd);
+            return false;
+        }
+        local.map = (char*)map;
+        madvise(map, local.length, MADV_SEQUENTIAL); // read once front to back
+    }
+    close(fd); // the mapping keeps its own reference to the file
+
+    return true;
+}
+
+// parse a local calendar opened by OpenLocalCalendar
+icalcomponent* ParseLocalCalendar(LocalCalendar &local) {
+    icalparser *parser = icalparser_new();
+    icalparser_set_gen_data(parser, &local);
+    icalcomponent *components = icalparser_parse(parser,
+        local.stream != nullptr ? LocalCalendar_LineGen_Stream : LocalCalendar_LineGen_Map);
+    icalparser_free(parser);
+    return components;
+}
+
+void CloseLocalCalendar(LocalCalendar &local) {
+    if (local.map != nullptr) {
+        munmap(local.map, local.length);
+        local.map = nullptr;
+    }
+    local.stream = nullptr;
+}
+
+// view a string from libical, which may be a nullptr
+std::string_view ViewOf(const char *s) {
+    return s != nullptr ? std::string_view(s) : std::string_view();
+}
+
+// copy a string into a new char* for the palm (where pilot-link expects to find it)
+char* CopyOf(std::string_view s) {
+    char *copy = new char[s.length() + 1];
+    memcpy(copy, s.data(), s.length());
+    copy[s.length()] = '\0';
+    return copy;
+}
+
+// the name of an attendee to show in the note, their CN (common name) if they have one,
+// otherwise fall back to the base value which is usually an e-mail address
+std::string_view AttendeeName(icalproperty *attendeep) {
+    icalparameter *cnp = icalproperty_get_first_parameter(attendeep, ICAL_CN_PARAMETER);
+    std::string_view name = ViewOf(cnp != nullptr ? icalparameter_get_cn(cnp) : nullptr);
+    if (name.length() > 0) {
+        return name;
+    }
+
+    name = ViewOf(icalproperty_get_attendee(attendeep));
+    if (name.length() >= 7 && strncasecmp(name.data(), "mailto:", 7) == 0) {
+        // strip off the mailto
+        name.remove_prefix(7);
+    }
+    return name;
+}
+
+// build the note from an event's location, attendees, and description
+// the length is added up first so the note is written once into a buffer of the right size
+// returns nullptr if there's nothing to put in the note
+char* BuildNote(std::string_view location, const std::vector<std::string_view> &attendees, std::string_view description) {
+    const std::string_view locationlabel("Location:\n"), attendeeslabel("Attendees:"), gap("\n\n");
+
+    size_t length = 0;
+    if (location.length() > 0) {
+        length += locationlabel.length() + location.length();
+    }
+    if (attendees.size() > 0) {
+        length += (length > 0 ? gap.length() : 0) + attendeeslabel.length();
+        for (std::string_view attendee : attendees) {
+            length += 1 + attendee.length();
+        }
+    }
+    if (description.length() > 0) {
+        length += (length > 0 ? gap.length() : 0) + description.length();
+    }
+    if (length == 0) {
+        return nullptr;
+    }
+
+    char *note = new char[length + 1];
+    char *at = note;
+    auto append = [&at](std::string_view s) { memcpy(at, s.data(), s.length()); at += s.length(); };
+    if (location.length() > 0) {
+        append(locationlabel);
+        append(location);
+    }
+    if (attendees.size() > 0) {
+        if (at != note) {
+            append(gap);
+        }
+        append(attendeeslabel);
+        for (std::string_view attendee : attendees) {
+            *at++ = '\n';
+            append(attendee);
+        }
+    }
+    if (description.length() > 0) {
+        if (at != note) {
+            append(gap);
+        }
+        append(description);
+    }
+    *at = '\0';
+
+    return note;
+}
+
 // there's some bug with pilot-link and libusb now that presents as pilot-link hanging
 // it looks like this might be a race condition with a mutex staying locked
+// in case it still hangs, the close is given timeout seconds (0 to wait forever) before the
+// process exits anyway, with EXIT_CLOSE_HUNG if the sync had already been ended successfully
 
-int pi_close_fixed(int sd, std::string port) {
+int pi_close_fixed(int sd, std::string port, int timeout) {
     std::cout << "    Closing connection... " << std::flush;
 
     // close the palm's connection
+    bool synced = false;
     if (sd >= 0) {
-        dlp_EndOfSync(sd, 0);
+        synced = DLP(dlp_EndOfSync(sd, 0), 0, 0) >= 0;
     }
 
     std::cout << "disconnecting... " << std::flush;
@@ -89,17 +319,115 @@ int pi_close_fixed(int sd, std::string port) {
     // the glorious one line version without error handling
     // libusb_unlock_events((((usb_dev_handle*)((pi_usb_data_t *)find_pi_socket(sd)->device->data)->ref)->handle)->dev->ctx);
 
-    // close the link to the palm
-    if (pi_close(sd) < 0) {
+    // close the link to the palm, on another thread so that we can give up on it if it hangs
+    int closed;
+    if (timeout > 0) {
+        auto closing = std::make_shared<std::promise<int>>();
+        std::future<int> result = closing->get_future();
+        std::thread([closing, sd]() { closing->set_value(DLP(pi_close(sd), 0, 0)); }).detach();
+
+        if (result.wait_for(std::chrono::seconds(timeout)) == std::future_status::timeout) {
+            std::cout << std::endl << "    WARNING closing the connection hung for " << timeout << " seconds, giving up" << std::endl;
+            if (synced) {
+                std::cout << "    (the sync had already finished, so the Palm should be up to date)" << std::endl;
+            }
+            dlptrace.report();
+            std::cout << std::flush;
+            std::cerr << std::flush;
+            // exit without running any clean up that might also get stuck on the hung thread
+            _exit(synced ? EXIT_CLOSE_HUNG : EXIT_FAILURE);
+        }
+        closed = result.get();
+    }
+    else {
+        closed = DLP(pi_close(sd), 0, 0);
+    }
+    if (closed < 0) {
         std::cerr << std::endl << "    ERROR closing socket to plam pilot" << std::endl << std::flush;
+        dlptrace.report();
         return -1;
     }
 
     std::cout << "done!" << std::endl << std::endl << std::flush;
 
+    dlptrace.report();
+
     return 0;
 }
 
+// serial rates to try in auto mode, fastest first
+const int SerialRates[] = {115200, 57600, 38400, 19200, 9600};
+
+// how much space there is on the palm for records, maxbytes if that's set, otherwise its free memory
+// leaving some for everything else, 0 if it's unknown (i.e., no limit)
+size_t SpaceForRecords(int sd, size_t maxbytes) {
+    size_t budget = maxbytes;
+    if (budget == 0) {
+        CardInfo cardinfo;
+        if (DLP(dlp_ReadStorageInfo(sd, 0, &cardinfo), 0, sizeof(cardinfo)) >= 0) {
+            size_t reserve = std::max((size_t)32768, (size_t)cardinfo.ramFree / 10);
+            budget = cardinfo.ramFree > reserve ? cardinfo.ramFree - reserve : 1;
+            std::cout << "    Palm has " << cardinfo.ramFree << " bytes free, using up to " << budget << std::endl;
+        }
+    }
+    return budget;
+}
+
+// open the datebook for writing, returns its handle, or -1 if it couldn't be opened (which is logged on the palm)
+int OpenDatebook(int sd) {
+    int db;
+    if (DLP(dlp_OpenDB(sd, 0, 0x80 | 0x40, "DatebookDB", &db), 0, 0) < 0) {
+        std::cerr << "    ERROR unable to open DatebookDB on Palm" << std::endl;
+        // (char*) is a little unsafe, but function does not edit the string
+        DLP(dlp_AddSyncLogEntry(sd, (char*)"Unable to open DatebookDB.\n"), 0, 0); // log on palm
+        return -1;
+    }
+    std::cout << "    DatebookDB opened." << std::endl << std::flush;
+    return db;
+}
+
+// delete every record in the datebook, returns false if that failed (which is logged on the palm)
+bool DeleteDatebook(int sd, int db) {
+    std::cout << "    Deleting existing Palm datebook..." << std::flush;
+    if (DLP(dlp_DeleteRecord(sd, db, 1, 0), 0, 0) < 0) {
+        std::cerr << std::endl << "    ERROR unable to delete DatebookDB records on Palm" << std::endl;
+        DLP(dlp_AddSyncLogEntry(sd, (char*)"Unable to delete DatebookDB records.\n"), 0, 0); // log on palm
+        return false;
+    }
+    std::cout << " done!" << std::endl << std::flush;
+    return true;
+}
+
+// measure the speed of the link with a short exchange, reading the datebook AppInfo block a few times
+// returns bytes per second, 0 if it couldn't be measured, or less than 0 if there were errors
+double ProbeLink(int sd) {
+    int db;
+    if (DLP(dlp_OpenDB(sd, 0, dlpOpenRead, "DatebookDB", &db), 0, 0) < 0) {
+        return 0; // e.g., a freshly reset palm without a datebook yet
+    }
+
+    pi_buffer_t *buf = pi_buffer_new(0xffff);
+    size_t bytes = 0;
+    bool failed = false;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < 4; i++) {
+        pi_buffer_clear(buf);
+        int result = DLP(dlp_ReadAppBlock(sd, db, 0, -1, buf), 0, buf->used);
+        if (result < 0) {
+            failed = true;
+            break;
+        }
+        bytes += result;
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    pi_buffer_free(buf);
+
+    if (DLP(dlp_CloseDB(sd, db), 0, 0) < 0 || failed) {
+        return -1;
+    }
+    return elapsed.count() > 0 ? bytes / elapsed.count() : 0;
+}
+
 // convert a icalrecurrencetype_weekday to int for pilot-link
 int weekday2int(icalrecurrencetype_weekday day) {
     switch (day) {
@@ -141,8 +469,1531 @@ const char* DayOfMonthString[35] = {
 	"domLastSat"
 };
 
+// a time_t as a UTC tm, without the shared buffer gmtime uses so that it's safe across threads
+tm UTCTime(time_t t) {
+    tm utc = {};
+    gmtime_r(&t, &utc);
+    return utc;
+}
+
+// asctime without the shared buffer (the same format, including the trailing newline)
+std::string AscTime(const tm &t) {
+    char buffer[32];
+    return asctime_r(&t, buffer) != nullptr ? buffer : "?\n";
+}
+
 // there are a few times when BYDAY and BYMONTH aren't supported in the palm calendar
 // provide a warning and mark to not copy
-#define UNSUPPORTED_ICAL(VAR, LABEL) if (recur.VAR[0] != ICAL_RECURRENCE_ARRAY_MAX) { failed = true; std::cout << "        WARNING unsupported "#LABEL", won't copy!" << std::endl; }
+#define UNSUPPORTED_ICAL(VAR, LABEL) if (recur.VAR[0] != ICAL_RECURRENCE_ARRAY_MAX) { failed = true; log << "        WARNING unsupported "#LABEL", won't copy!" << std::endl; }
 // sometimes more than one value is suggested by the ical when palm only supports one
-#define UNSUPPORTED_ICAL1(VAR, LABEL) if (recur.VAR[1] != ICAL_RECURRENCE_ARRAY_MAX) { failed = true; std::cout << "        WARNING unsupported "#LABEL", won't copy!" << std::endl; }
+#define UNSUPPORTED_ICAL1(VAR, LABEL) if (recur.VAR[1] != ICAL_RECURRENCE_ARRAY_MAX) { failed = true; log << "        WARNING unsupported "#LABEL", won't copy!" << std::endl; }
+
+// expand a repeating event the palm can't represent into individual one-off appointments
+// only instances starting between windowstart and windowend are kept, up to maxinstances of them
+// (description and note are shared with the parent appointment rather than copied)
+std::vector<Appointment> ExpandRecurrence(icalcomponent *c, const Appointment &appointment, icalrecurrencetype recur,
+        time_t windowstart, time_t windowend, int maxinstances) {
+
+    std::vector<Appointment> instances;
+
+    icaltimetype start = icalcomponent_get_dtstart(c);
+    icaltimetype end = icalcomponent_get_dtend(c);
+    time_t start_time_t = icaltime_as_timet_with_zone(start, icaltime_get_timezone(start));
+    time_t duration = icaltime_as_timet_with_zone(end, icaltime_get_timezone(end)) - start_time_t;
+
+    // the EXDATEs still apply to the individual events
+    std::vector<icaltimetype> exdates;
+    for(icalproperty *exdatep = icalcomponent_get_first_property(c, ICAL_EXDATE_PROPERTY); exdatep != 0;
+            exdatep = icalcomponent_get_next_property(c, ICAL_EXDATE_PROPERTY)) {
+        exdates.push_back(icalproperty_get_exdate(exdatep));
+    }
+
+    icalrecur_iterator *it = icalrecur_iterator_new(recur, start);
+    if (it == nullptr) {
+        return instances;
+    }
+
+    // skip straight to the start of the window if we can (libical doesn't allow this with COUNT)
+    if (recur.count == 0 && windowstart > start_time_t) {
+        icalrecur_iterator_set_start(it, icaltime_from_timet_with_zone(windowstart, icaltime_is_date(start),
+            (icaltimezone*)icaltime_get_timezone(start)));
+    }
+
+    for (icaltimetype next = icalrecur_iterator_next(it); !icaltime_is_null_time(next) && (int)instances.size() < maxinstances;
+            next = icalrecur_iterator_next(it)) {
+
+        time_t next_time_t = icaltime_as_timet_with_zone(next, icaltime_get_timezone(next));
+        if (next_time_t > windowend) {
+            break;
+        }
+        if (next_time_t < windowstart) {
+            continue;
+        }
+
+        bool excluded = false;
+        for (icaltimetype exdate : exdates) {
+            if (icaltime_is_date(exdate) || icaltime_is_date(next) ?
+                    (exdate.year == next.year && exdate.month == next.month && exdate.day == next.day) :
+                    icaltime_as_timet_with_zone(exdate, icaltime_get_timezone(exdate)) == next_time_t) {
+                excluded = true;
+                break;
+            }
+        }
+        if (excluded) {
+            continue;
+        }
+
+        Appointment instance = appointment;
+        instance.begin = UTCTime(next_time_t);
+        instance.end = UTCTime(next_time_t + duration);
+        instance.repeatType         = repeatNone;
+        instance.repeatForever      = 0;
+        instance.repeatEnd.tm_year  = 0;
+        instance.repeatEnd.tm_mon   = 0;
+        instance.repeatEnd.tm_mday  = 0;
+        instance.repeatEnd.tm_wday  = 0;
+        instance.repeatFrequency    = 0;
+        for (int i = 0; i < 7; i++) instance.repeatDays[i] = 0;
+        instance.exceptions         = 0;
+        instance.exception          = nullptr;
+        instances.push_back(instance);
+    }
+    icalrecur_iterator_free(it);
+
+    return instances;
+}
+
+// clip a repeating event the palm can represent to the sync window, moving the start forward to the
+// first occurrence in the window and ending the repeat at the end of the window (windowend of 0 is no limit)
+// returns false if there are no occurrences inside the window
+bool ClipRecurrence(icalcomponent *c, Appointment &appointment, icalrecurrencetype recur, time_t windowstart, time_t windowend,
+        std::ostream &log) {
+
+    icaltimetype start = icalcomponent_get_dtstart(c);
+    time_t start_time_t = icaltime_as_timet_with_zone(start, icaltime_get_timezone(start));
+
+    if (start_time_t < windowstart) {
+        icalrecur_iterator *it = icalrecur_iterator_new(recur, start);
+        if (it == nullptr) {
+            return true; // leave it be, the palm can still work it out
+        }
+
+        // skip straight to the start of the window if we can (libical doesn't allow this with COUNT)
+        if (recur.count == 0) {
+            icalrecur_iterator_set_start(it, icaltime_from_timet_with_zone(windowstart, icaltime_is_date(start),
+                (icaltimezone*)icaltime_get_timezone(start)));
+        }
+
+        time_t first = 0;
+        for (icaltimetype next = icalrecur_iterator_next(it); !icaltime_is_null_time(next); next = icalrecur_iterator_next(it)) {
+            time_t next_time_t = icaltime_as_timet_with_zone(next, icaltime_get_timezone(next));
+            if (next_time_t >= windowstart) {
+                first = next_time_t;
+                break;
+            }
+        }
+        icalrecur_iterator_free(it);
+
+        if (first == 0) {
+            return false; // repeats ended before the window
+        }
+
+        // move the start and end along together
+        time_t begin_time_t = timegm(&appointment.begin);
+        time_t end_time_t = timegm(&appointment.end) + (first - begin_time_t);
+        appointment.begin = UTCTime(first);
+        appointment.end = UTCTime(end_time_t);
+        log << "        Clipped start to " << AscTime(appointment.begin);
+    }
+
+    if (windowend > 0) {
+        if (timegm(&appointment.begin) > windowend) {
+            return false; // doesn't start until after the window
+        }
+
+        if (appointment.repeatForever || timegm(&appointment.repeatEnd) > windowend) {
+            appointment.repeatForever = 0;
+            appointment.repeatEnd = UTCTime(windowend);
+            appointment.repeatEnd.tm_hour = 23; // palm os ends on the day specified
+            appointment.repeatEnd.tm_min = 59;
+            appointment.repeatEnd.tm_sec = 59;
+            log << "        Clipped end to " << AscTime(appointment.repeatEnd);
+        }
+    }
+
+    return true;
+}
+
+// add an exception to a repeating event, e.g., for one of its repeats that's been moved or cancelled
+void AddException(Appointment &appointment, const tm &exception) {
+
+    // new array at new size - argh, array resizing
+    appointment.exceptions++;
+    tm *newexception = (tm*)malloc(appointment.exceptions * sizeof(tm));
+
+    // copy over existing exceptions into new array
+    for (int i = 0; i < appointment.exceptions-1; i++) {
+        newexception[i] = appointment.exception[i];
+    }
+    newexception[appointment.exceptions-1] = exception;
+
+    // cuckoo time
+    free(appointment.exception); // clear out old egg
+    appointment.exception = newexception; // put new egg in nest
+}
+
+// drop exceptions that fall outside of a repeating event's start and end (e.g., after clipping)
+// returns the number of exceptions removed
+int PruneExceptions(Appointment &appointment) {
+    if (appointment.exceptions == 0 || appointment.repeatType == repeatNone) {
+        return 0;
+    }
+
+    // compare only on the date, as that's all the palm uses for exceptions
+    #define DATEKEY(TM) (((TM).tm_year * 100 + (TM).tm_mon) * 100 + (TM).tm_mday)
+    int first = DATEKEY(appointment.begin), last = DATEKEY(appointment.repeatEnd);
+    int kept = 0;
+    for (int i = 0; i < appointment.exceptions; i++) {
+        int at = DATEKEY(appointment.exception[i]);
+        if (at >= first && (appointment.repeatForever || at <= last)) {
+            appointment.exception[kept++] = appointment.exception[i];
+        }
+    }
+    #undef DATEKEY
+
+    int removed = appointment.exceptions - kept;
+    appointment.exceptions = kept;
+    return removed;
+}
+
+// convert the times of the appointments in which from UTC to the given time zone (all day events stay as they are)
+void ConvertTimezone(std::vector<Appointment> &appointments, const std::vector<int> &which, const std::string &timezone) {
+    // localtime reads the time zone from the TZ environment variable
+    // per https://rl.se/convert-utc-to-local-time
+    const char *tz = getenv("TZ");
+    std::string oldtz = tz != nullptr ? tz : "";
+    setenv("TZ", timezone.c_str(), 1);
+    tzset();
+
+    for (int i : which) {
+        Appointment &appointment = appointments[i];
+        if (appointment.event) {
+            continue;
+        }
+
+        // timegm takes the tm struct and ignores TZ converting to time_t (assuming UTC, which it is)
+        // localtime takes time_t and converts to a tm struct taking TZ into account
+        // (repeat ends and exceptions are only dates, so they don't need converting)
+        time_t stamp = timegm(&appointment.begin);
+        localtime_r(&stamp, &appointment.begin);
+        stamp = timegm(&appointment.end);
+        localtime_r(&stamp, &appointment.end);
+    }
+
+    if (tz != nullptr) {
+        setenv("TZ", oldtz.c_str(), 1);
+    }
+    else {
+        unsetenv("TZ");
+    }
+    tzset();
+}
+
+// how far an appointment is from today in seconds, 0 if it is happening or repeating over today
+// (used to decide what's most important to keep when space on the palm is tight)
+time_t TimeFromToday(Appointment &appointment, time_t today) {
+    time_t begin = timegm(&appointment.begin);
+    if (begin > today) {
+        return begin - today;
+    }
+
+    time_t end = timegm(&appointment.end);
+    if (appointment.repeatType != repeatNone) {
+        if (appointment.repeatForever) {
+            return 0;
+        }
+        end = std::max(end, timegm(&appointment.repeatEnd));
+    }
+    return end >= today ? 0 : today - end;
+}
+
+// cut an appointment's note down to at most length bytes, marking that it's been cut short
+// a new note is allocated as the existing one may be shared with other appointments
+// returns false if there was nothing to cut, utf8 is false once the note's been transcoded to a single byte charset
+bool TruncateNote(Appointment &appointment, size_t length, bool utf8) {
+    if (appointment.note == nullptr) {
+        return false;
+    }
+    size_t notelength = strlen(appointment.note);
+    if (notelength <= length) {
+        return false;
+    }
+
+    if (length < 4) {
+        appointment.note = nullptr; // no room for anything useful
+        return true;
+    }
+
+    // leave room for the ..., and don't split a UTF-8 character (in CP1252 0x80-0xBF are characters
+    // of their own, e.g., € and ’, so there's nothing to back off over)
+    size_t keep = length - 3;
+    while (utf8 && keep > 0 && (appointment.note[keep] & 0xC0) == 0x80) {
+        keep--;
+    }
+
+    char *note = new char[keep + 4];
+    memcpy(note, appointment.note, keep);
+    strcpy(note + keep, "...");
+    appointment.note = note;
+    return true;
+}
+
+// pack an appointment ready for copying to the palm, cutting the note down if the record would be too big
+// (counting that in truncated), returns nullptr if it's too big even without a note (lots of exceptions?)
+// the buffer is only as big as the record, as a whole calendar of them is kept until they're written
+pi_buffer_t* PackAppointment(Appointment &appointment, int &truncated, bool utf8) {
+    pi_buffer_t *record = pi_buffer_new(0xffff);
+    pack_Appointment(&appointment, record, datebook_v1);
+
+    // a record can't be more than 64k, so cut the note down until it fits
+    while (record->used > MAX_RECORD_SIZE && appointment.note != nullptr) {
+        size_t over = record->used - MAX_RECORD_SIZE;
+        size_t notelength = strlen(appointment.note);
+        TruncateNote(appointment, notelength > over ? notelength - over : 0, utf8);
+        pi_buffer_clear(record);
+        pack_Appointment(&appointment, record, datebook_v1);
+        truncated++;
+    }
+    if (record->used > MAX_RECORD_SIZE) {
+        pi_buffer_free(record);
+        return nullptr;
+    }
+
+    pi_buffer_t *fitted = pi_buffer_new(record->used);
+    pi_buffer_append(fitted, record->data, record->used);
+    pi_buffer_free(record);
+    return fitted;
+}
+
+// when space on the palm runs short, cut a packed appointment's note down to a preview and pack it again,
+// returns false if there wasn't a note to cut (so the record's as small as it'll get)
+bool ShortenRecord(Appointment &appointment, pi_buffer_t *record, bool utf8) {
+    if (!TruncateNote(appointment, NOTE_PREVIEW, utf8)) {
+        return false;
+    }
+    pi_buffer_clear(record);
+    pack_Appointment(&appointment, record, datebook_v1);
+    return true;
+}
+
+// a key identifying an event by its content rather than its UID, for spotting the same event in
+// different calendars: the summary (ignoring case and spacing), start, end, and how it repeats
+std::string DuplicateKey(const Appointment &appointment) {
+    std::string key;
+
+    if (appointment.description != nullptr) {
+        bool space = false;
+        for (const char *c = appointment.description; *c != '\0'; c++) {
+            if (isspace((unsigned char)*c)) {
+                space = key.length() > 0;
+                continue;
+            }
+            if (space) {
+                key += ' ';
+                space = false;
+            }
+            key += tolower((unsigned char)*c);
+        }
+    }
+
+    char times[256];
+    const tm &b = appointment.begin, &e = appointment.end, &r = appointment.repeatEnd;
+    snprintf(times, sizeof(times), "|%d|%04d%02d%02d%02d%02d|%04d%02d%02d%02d%02d|%d|%d|%d|%d|%d%d%d%d%d%d%d|%04d%02d%02d",
+        appointment.event,
+        b.tm_year, b.tm_mon, b.tm_mday, b.tm_hour, b.tm_min,
+        e.tm_year, e.tm_mon, e.tm_mday, e.tm_hour, e.tm_min,
+        appointment.repeatType, appointment.repeatFrequency, appointment.repeatType == repeatMonthlyByDay ? appointment.repeatDay : 0,
+        appointment.repeatForever,
+        appointment.repeatDays[0], appointment.repeatDays[1], appointment.repeatDays[2], appointment.repeatDays[3],
+        appointment.repeatDays[4], appointment.repeatDays[5], appointment.repeatDays[6],
+        appointment.repeatForever || appointment.repeatType == repeatNone ? 0 : r.tm_year,
+        appointment.repeatForever || appointment.repeatType == repeatNone ? 0 : r.tm_mon,
+        appointment.repeatForever || appointment.repeatType == repeatNone ? 0 : r.tm_mday);
+    key += times;
+
+    return key;
+}
+
+// a FILTERS rule, events matching any part of it are left out (before they're converted)
+// the values are turned into libical's enums and the regexes compiled once, when the config is read
+struct EventFilter {
+    std::string uri; // the calendar it applies to, empty for all of them
+    std::string email; // our address, for PARTSTAT
+    std::vector<int> partstat, transp, status, classes;
+    std::string summarytext, locationtext; // as written in the config, for the log
+    std::regex summary, location; // only used if the text isn't empty
+};
+
+// turn a string or list of strings setting into libical enum values (by convert), false if one isn't recognised
+template <typename F>
+bool FilterValues(const libconfig::Setting &rule, const char *name, std::vector<int> &values, F convert) {
+    if (!rule.exists(name)) {
+        return true;
+    }
+    const libconfig::Setting &setting = rule[name];
+    std::vector<std::string> strings;
+    if (setting.isList() || setting.isArray()) {
+        for (const libconfig::Setting &value : setting) {
+            strings.push_back(value.c_str());
+        }
+    }
+    else {
+        strings.push_back(setting.c_str());
+    }
+    for (std::string &value : strings) {
+        for (char &c : value) {
+            c = toupper((unsigned char)c);
+        }
+        int e = convert(value.c_str());
+        if (e == 0) {
+            std::cerr << "    ERROR unknown " << name << " value " << value << " in FILTERS" << std::endl;
+            return false;
+        }
+        values.push_back(e);
+    }
+    return true;
+}
+
+// read the FILTERS setting, a list of rules, returns false if any of it doesn't make sense
+bool LoadFilters(const libconfig::Setting &setting, std::vector<EventFilter> &filters) {
+    try {
+        for (const libconfig::Setting &rule : setting) {
+            EventFilter filter;
+            rule.lookupValue("URI", filter.uri);
+            rule.lookupValue("EMAIL", filter.email);
+            bool ok = FilterValues(rule, "PARTSTAT", filter.partstat, icalparameter_string_to_enum) &&
+                FilterValues(rule, "TRANSP", filter.transp, [](const char *s) { return icalproperty_kind_and_string_to_enum(ICAL_TRANSP_PROPERTY, s); }) &&
+                FilterValues(rule, "STATUS", filter.status, [](const char *s) { return icalproperty_kind_and_string_to_enum(ICAL_STATUS_PROPERTY, s); }) &&
+                FilterValues(rule, "CLASS", filter.classes, [](const char *s) { return icalproperty_kind_and_string_to_enum(ICAL_CLASS_PROPERTY, s); });
+            if (!ok) {
+                return false;
+            }
+            if (filter.partstat.size() > 0 && filter.email.length() == 0) {
+                std::cerr << "    ERROR FILTERS PARTSTAT needs an EMAIL to know which attendee is us" << std::endl;
+                return false;
+            }
+            if (rule.lookupValue("SUMMARY", filter.summarytext) && filter.summarytext.length() > 0) {
+                filter.summary = std::regex(filter.summarytext, std::regex::icase | std::regex::optimize);
+            }
+            if (rule.lookupValue("LOCATION", filter.locationtext) && filter.locationtext.length() > 0) {
+                filter.location = std::regex(filter.locationtext, std::regex::icase | std::regex::optimize);
+            }
+            filters.push_back(std::move(filter));
+        }
+    }
+    catch (const libconfig::SettingException &e) {
+        std::cerr << "    ERROR with FILTERS setting " << e.getPath() << std::endl;
+        return false;
+    }
+    catch (const std::regex_error &e) {
+        std::cerr << "    ERROR with a FILTERS regex: " << e.what() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// check an event against the filters, returns why it's been filtered out or nullptr if it hasn't
+// only looks at the properties the filters need, so is much quicker than converting the event
+const char* FilterEvent(icalcomponent *c, const std::vector<const EventFilter*> &filters) {
+    auto has = [](const std::vector<int> &values, int value) {
+        return std::find(values.begin(), values.end(), value) != values.end();
+    };
+
+    for (const EventFilter *filter : filters) {
+        if (filter->status.size() > 0 && has(filter->status, icalcomponent_get_status(c))) {
+            return "STATUS";
+        }
+        icalproperty *p;
+        if (filter->transp.size() > 0 && (p = icalcomponent_get_first_property(c, ICAL_TRANSP_PROPERTY)) != nullptr &&
+                has(filter->transp, icalproperty_get_transp(p))) {
+            return "TRANSP";
+        }
+        if (filter->classes.size() > 0 && (p = icalcomponent_get_first_property(c, ICAL_CLASS_PROPERTY)) != nullptr &&
+                has(filter->classes, icalproperty_get_class(p))) {
+            return "CLASS";
+        }
+        if (filter->partstat.size() > 0) {
+            for (p = icalcomponent_get_first_property(c, ICAL_ATTENDEE_PROPERTY); p != nullptr;
+                    p = icalcomponent_get_next_property(c, ICAL_ATTENDEE_PROPERTY)) {
+
+                // the attendee is usually a mailto: address
+                std::string_view attendee = ViewOf(icalproperty_get_attendee(p));
+                if (attendee.length() >= 7 && strncasecmp(attendee.data(), "mailto:", 7) == 0) {
+                    attendee.remove_prefix(7);
+                }
+                if (attendee.length() != filter->email.length() ||
+                        strncasecmp(attendee.data(), filter->email.data(), attendee.length()) != 0) {
+                    continue;
+                }
+                icalparameter *partstat = icalproperty_get_first_parameter(p, ICAL_PARTSTAT_PARAMETER);
+                if (partstat != nullptr && has(filter->partstat, icalparameter_get_partstat(partstat))) {
+                    return "PARTSTAT";
+                }
+            }
+        }
+        if (filter->summarytext.length() > 0) {
+            const char *summary = icalcomponent_get_summary(c);
+            if (summary != nullptr && std::regex_search(summary, filter->summary)) {
+                return "SUMMARY";
+            }
+        }
+        if (filter->locationtext.length() > 0) {
+            const char *location = icalcomponent_get_location(c);
+            if (location != nullptr && std::regex_search(location, filter->location)) {
+                return "LOCATION";
+            }
+        }
+    }
+    return nullptr;
+}
+
+// the calendars in a URI setting, which can be a single string or a list of them
+// returns false if it's neither
+bool ReadURIs(const libconfig::Setting &setting, std::vector<std::string> &uris) {
+    if (setting.isList() || setting.isArray()) {
+        for (const libconfig::Setting &uri : setting) {
+            if (uri.getType() == libconfig::Setting::TypeString) {
+                uris.push_back(std::string(uri));
+            }
+        }
+        return true;
+    }
+    else if (setting.getType() == libconfig::Setting::TypeString) {
+        uris.push_back(std::string(setting));
+        return true;
+    }
+    return false;
+}
+
+// the PROFILES entry for a palm user name, nullptr if there isn't one
+const libconfig::Setting* FindProfile(const libconfig::Setting &profiles, const std::string &user) {
+    for (const libconfig::Setting &profile : profiles) {
+        std::string name;
+        if (profile.lookupValue("USER", name) && name == user) {
+            return &profile;
+        }
+    }
+    return nullptr;
+}
+
+// the settings that affect how a VEVENT is converted into an Appointment
+struct ConvertOptions {
+    time_t windowstart = 0, windowend = 0; // the sync window, windowend of 0 is no limit
+    time_t expandend = 0; // expand repeats the palm can't represent up until here
+    int expandmax = 0;
+    bool skipnotes = false, doalarms = true;
+    bool transcode = true; // from UTF-8 to the palm's character set
+    char unmappable = '?'; // for characters the palm doesn't have, 0 to leave them out
+    std::vector<const EventFilter*> filters; // those that apply to the calendar being converted
+};
+
+// a VEVENT converted to an Appointment, along with what's needed to merge it with any others
+// sharing its UID (which has to wait until all of the events are converted, in order)
+struct ConvertedEvent {
+    Appointment appointment = {};
+    std::vector<Appointment> instances; // individual events for a repeat the palm can't represent
+    std::string uid;
+    bool isarecurrence = false;
+    time_t recurrenceid = 0; // which repeat of the parent a recurrence replaces
+    bool failed = false; // won't be copied to the palm
+    bool filtered = false; // left out by FILTERS, not converted at all
+    // which optional properties were present, those that weren't are kept from an earlier copy when merging
+    bool hasdescription = false, hasnote = false, hasalarm = false, hasrrule = false;
+    std::string log; // what would have been printed while converting, printed when merging
+    bool cached = false; // taken from the conversion cache rather than converted
+    uint64_t hash = 0; // of the VEVENT, to store it in the conversion cache
+    std::string packed; // the conversion before the sync window is applied, for the conversion cache
+};
+
+// run work(i) for i from 0 to count-1 spread across threads (the calling thread included),
+// each thread taking the next index as it finishes the last so that slow items balance out
+template <typename F>
+void ParallelFor(int count, int threads, F work) {
+    threads = std::max(1, std::min(threads, count));
+    std::atomic<int> next(0);
+    auto worker = [&]() {
+        for (int i = next++; i < count; i = next++) {
+            work(i);
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (int t = 1; t < threads; t++) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (std::thread &thread : pool) {
+        thread.join();
+    }
+}
+
+
+/** conversion cache **/
+
+// most of a calendar is the same from one run to the next, so each event's conversion (before it's
+// clipped to the sync window, which changes daily) is kept in a file, keyed by a hash of the VEVENT's
+// text. the file is memory mapped on start up and rewritten with the events seen on each run
+
+#define CONVERSION_CACHE_MAGIC "SC2CACHE"
+#define CONVERSION_CACHE_VERSION 3 // change whenever ConvertEventFields or the packing changes
+
+struct ConversionCache {
+    bool enabled = false;
+    uint64_t seed = 0; // mixed into each event's hash, changes with the calendar's timezones and the settings
+    char *map = nullptr; // memory mapped cache file
+    size_t length = 0;
+    std::unordered_map<uint64_t, std::string_view> entries; // event hash to packed conversion inside map
+};
+
+// 64 bit FNV-1a, continuing on from hash
+uint64_t Hash64(std::string_view s, uint64_t hash = 14695981039346656037ULL) {
+    for (unsigned char c : s) {
+        hash = (hash ^ c) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// hash a component's text as it would appear in an ical file
+uint64_t HashComponent(icalcomponent *c, uint64_t seed) {
+    char *text = icalcomponent_as_ical_string_r(c);
+    uint64_t hash = Hash64(ViewOf(text), seed);
+    icalmemory_free_buffer(text);
+    return hash;
+}
+
+// pack the parts of a ConvertedEvent that don't depend on the sync window, to be unpacked by UnpackConverted
+// (this is only ever read back on the same machine, so numbers are kept in their native form)
+std::string PackConverted(const ConvertedEvent &converted) {
+    std::string packed;
+    auto number = [&packed](int64_t n) { packed.append((const char*)&n, sizeof(n)); };
+    auto time = [&number](const tm &t) {
+        for (int n : {t.tm_sec, t.tm_min, t.tm_hour, t.tm_mday, t.tm_mon, t.tm_year, t.tm_wday, t.tm_yday}) {
+            number(n);
+        }
+    };
+    auto text = [&packed, &number](const char *s, size_t length) {
+        number(s != nullptr ? (int64_t)length : -1);
+        if (s != nullptr) {
+            packed.append(s, length);
+        }
+    };
+
+    const Appointment &appointment = converted.appointment;
+    number(converted.isarecurrence | converted.failed << 1 | converted.hasdescription << 2 |
+        converted.hasnote << 3 | converted.hasalarm << 4 | converted.hasrrule << 5);
+    number(converted.recurrenceid);
+    text(converted.uid.c_str(), converted.uid.length());
+    text(converted.log.c_str(), converted.log.length());
+
+    for (int n : {appointment.event, appointment.alarm, appointment.advance, (int)appointment.advanceUnits,
+            (int)appointment.repeatType, appointment.repeatForever, appointment.repeatFrequency,
+            (int)appointment.repeatDay, appointment.repeatWeekstart, appointment.exceptions}) {
+        number(n);
+    }
+    for (int i = 0; i < 7; i++) {
+        number(appointment.repeatDays[i]);
+    }
+    time(appointment.begin);
+    time(appointment.end);
+    time(appointment.repeatEnd);
+    for (int i = 0; i < appointment.exceptions; i++) {
+        time(appointment.exception[i]);
+    }
+    text(appointment.description, appointment.description != nullptr ? strlen(appointment.description) : 0);
+    text(appointment.note, appointment.note != nullptr ? strlen(appointment.note) : 0);
+
+    return packed;
+}
+
+// unpack a ConvertedEvent packed by PackConverted, returns false if the packed data isn't valid
+bool UnpackConverted(std::string_view packed, ConvertedEvent &converted) {
+    size_t at = 0;
+    bool valid = true;
+    auto number = [&]() {
+        int64_t n = 0;
+        if (at + sizeof(n) > packed.length()) {
+            valid = false;
+            return n;
+        }
+        memcpy(&n, packed.data() + at, sizeof(n));
+        at += sizeof(n);
+        return n;
+    };
+    auto time = [&number](tm &t) {
+        t = {};
+        for (int *n : {&t.tm_sec, &t.tm_min, &t.tm_hour, &t.tm_mday, &t.tm_mon, &t.tm_year, &t.tm_wday, &t.tm_yday}) {
+            *n = (int)number();
+        }
+    };
+    auto text = [&]() -> std::string_view {
+        int64_t length = number();
+        if (length < 0 || !valid || at + length > packed.length()) {
+            valid = valid && length == -1;
+            return std::string_view(); // nullptr
+        }
+        std::string_view s = packed.substr(at, length);
+        at += length;
+        return s;
+    };
+
+    Appointment &appointment = converted.appointment;
+    int flags = (int)number();
+    converted.isarecurrence = flags & 1;
+    converted.failed = flags & 2;
+    converted.hasdescription = flags & 4;
+    converted.hasnote = flags & 8;
+    converted.hasalarm = flags & 16;
+    converted.hasrrule = flags & 32;
+    converted.recurrenceid = (time_t)number();
+    converted.uid = text();
+    converted.log = text();
+
+    appointment.event = (int)number();
+    appointment.alarm = (int)number();
+    appointment.advance = (int)number();
+    appointment.advanceUnits = (alarmTypes)number();
+    appointment.repeatType = (repeatTypes)number();
+    appointment.repeatForever = (int)number();
+    appointment.repeatFrequency = (int)number();
+    appointment.repeatDay = (DayOfMonthType)number();
+    appointment.repeatWeekstart = (int)number();
+    appointment.exceptions = (int)number();
+    for (int i = 0; i < 7; i++) {
+        appointment.repeatDays[i] = (int)number();
+    }
+    time(appointment.begin);
+    time(appointment.end);
+    time(appointment.repeatEnd);
+    if (!valid || appointment.exceptions < 0 || appointment.exceptions > (int)packed.length()) {
+        return false;
+    }
+    appointment.exception = (tm*)malloc(appointment.exceptions * sizeof(tm)); // as ConvertEventFields
+    for (int i = 0; i < appointment.exceptions; i++) {
+        time(appointment.exception[i]);
+    }
+
+    // text is copied out of the cache as the palm side expects its own char*
+    std::string_view description = text(), note = text();
+    if (!valid || at != packed.length()) {
+        free(appointment.exception);
+        appointment.exception = nullptr;
+        return false;
+    }
+    appointment.description = description.data() != nullptr ? CopyOf(description) : nullptr;
+    appointment.note = note.data() != nullptr ? CopyOf(note) : nullptr;
+
+    return true;
+}
+
+// open and index a cache file written by SaveConversionCache, an empty cache if there isn't one yet
+// returns false (with an empty cache) if the file couldn't be used
+bool OpenConversionCache(const std::string &path, ConversionCache &cache) {
+    cache.enabled = true;
+
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0) {
+        return errno == ENOENT; // not a problem, it's made at the end
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < 16) {
+        close(fd);
+        return false;
+    }
+
+    void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    cache.map = (char*)map;
+    cache.length = st.st_size;
+
+    // header then entries of hash, length, and packed conversion
+    uint32_t version, count;
+    memcpy(&version, cache.map + 8, sizeof(version));
+    memcpy(&count, cache.map + 12, sizeof(count));
+    if (memcmp(cache.map, CONVERSION_CACHE_MAGIC, 8) != 0 || version != CONVERSION_CACHE_VERSION) {
+        return true; // from a different version, start again
+    }
+
+    cache.entries.reserve(count);
+    size_t at = 16;
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t hash;
+        uint32_t length;
+        if (at + sizeof(hash) + sizeof(length) > cache.length) {
+            break;
+        }
+        memcpy(&hash, cache.map + at, sizeof(hash));
+        memcpy(&length, cache.map + at + sizeof(hash), sizeof(length));
+        at += sizeof(hash) + sizeof(length);
+        if (at + length > cache.length) {
+            break;
+        }
+        cache.entries.emplace(hash, std::string_view(cache.map + at, length));
+        at += length;
+    }
+
+    return true;
+}
+
+void CloseConversionCache(ConversionCache &cache) {
+    cache.entries.clear();
+    if (cache.map != nullptr) {
+        munmap(cache.map, cache.length);
+        cache.map = nullptr;
+    }
+}
+
+// write out a new cache file with the given entries of hash and packed conversion
+// written alongside and renamed into place, so an interrupted run doesn't leave a broken cache
+bool SaveConversionCache(const std::string &path, const std::vector<std::pair<uint64_t, std::string>> &entries) {
+    std::string temporary = path + ".new";
+    FILE *file = fopen(temporary.c_str(), "wb");
+    if (file == nullptr) {
+        return false;
+    }
+
+    uint32_t version = CONVERSION_CACHE_VERSION, count = entries.size();
+    bool failed = fwrite(CONVERSION_CACHE_MAGIC, 8, 1, file) != 1 ||
+        fwrite(&version, sizeof(version), 1, file) != 1 || fwrite(&count, sizeof(count), 1, file) != 1;
+    for (const auto &[hash, packed] : entries) {
+        uint32_t length = packed.length();
+        failed = failed || fwrite(&hash, sizeof(hash), 1, file) != 1 || fwrite(&length, sizeof(length), 1, file) != 1 ||
+            fwrite(packed.data(), 1, length, file) != length;
+    }
+
+    if (fclose(file) != 0 || failed || rename(temporary.c_str(), path.c_str()) != 0) {
+        remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+
+/** what's been written to each palm **/
+
+// kept in STATEDIR, in files named after the palm's user so that each palm has its own
+
+// a file in directory for the palm with user
+std::string DeviceFile(const std::string &directory, const std::string &kind, const PilotUser &user) {
+    char name[64];
+    snprintf(name, sizeof(name), "%s-%lu-%016llx", kind.c_str(), (unsigned long)user.userID,
+        (unsigned long long)Hash64(ViewOf(user.username)));
+    return (std::filesystem::path(directory) / name).string();
+}
+
+// the records written to a palm so far, kept on disk as they're written so that if the sync is
+// interrupted (cable bumped, palm timed out) the next one can carry on from where it left off
+
+struct Checkpoint {
+    time_t lastsync = 0; // the palm's last sync date when this was written, it only applies if that's unchanged
+    std::vector<std::pair<recordid_t, uint64_t>> records; // record id and hash of the packed record
+};
+
+// read a checkpoint written by StartCheckpoint and AddCheckpoint, returns false if there isn't one
+bool LoadCheckpoint(const std::string &filename, Checkpoint &checkpoint) {
+    FILE *file = fopen(filename.c_str(), "r");
+    if (file == nullptr) {
+        return false;
+    }
+
+    long long lastsync = 0;
+    bool valid = fscanf(file, "lastsync %lld\n", &lastsync) == 1;
+    checkpoint.lastsync = lastsync;
+    unsigned long id;
+    unsigned long long hash;
+    while (valid && fscanf(file, "%lu %llx\n", &id, &hash) == 2) {
+        checkpoint.records.emplace_back(id, hash);
+    }
+    fclose(file);
+    return valid;
+}
+
+// start a new checkpoint file including the records already on the palm from the last one,
+// returns the file to add records to as they're written
+FILE* StartCheckpoint(const std::string &filename, const Checkpoint &checkpoint) {
+    FILE *file = fopen(filename.c_str(), "w");
+    if (file == nullptr) {
+        return nullptr;
+    }
+    fprintf(file, "lastsync %lld\n", (long long)checkpoint.lastsync);
+    for (const auto &[id, hash] : checkpoint.records) {
+        fprintf(file, "%lu %016llx\n", (unsigned long)id, (unsigned long long)hash);
+    }
+    fflush(file);
+    return file;
+}
+
+// note a record that's been written to the palm, flushed straight away so it survives the process dying
+void AddCheckpoint(FILE *file, recordid_t id, uint64_t hash) {
+    if (file != nullptr) {
+        fprintf(file, "%lu %016llx\n", (unsigned long)id, (unsigned long long)hash);
+        fflush(file);
+    }
+}
+
+// a fingerprint of what was last written for each calendar, by category name, to tell which have changed
+// it only applies if the palm's last sync date is the one saved with it (i.e., nothing else has synced it)
+bool LoadFingerprints(const std::string &filename, time_t lastsync, std::unordered_map<std::string, uint64_t> &fingerprints) {
+    FILE *file = fopen(filename.c_str(), "r");
+    if (file == nullptr) {
+        return false;
+    }
+
+    long long savedsync;
+    bool valid = fscanf(file, "lastsync %lld\n", &savedsync) == 1 && savedsync == lastsync;
+    unsigned long long fingerprint;
+    char name[64];
+    while (valid && fscanf(file, "%llx %63[^\n]\n", &fingerprint, name) == 2) {
+        fingerprints[name] = fingerprint;
+    }
+    fclose(file);
+    return valid;
+}
+
+bool SaveFingerprints(const std::string &filename, time_t lastsync, const std::unordered_map<std::string, uint64_t> &fingerprints) {
+    FILE *file = fopen(filename.c_str(), "w");
+    if (file == nullptr) {
+        return false;
+    }
+    fprintf(file, "lastsync %lld\n", (long long)lastsync);
+    for (const auto &[name, fingerprint] : fingerprints) {
+        fprintf(file, "%016llx %s\n", (unsigned long long)fingerprint, name.c_str());
+    }
+    return fclose(file) == 0;
+}
+
+// what the last successful sync wrote to a palm and how it left the datebook, if neither has changed
+// since then there's nothing to do
+struct SyncState {
+    time_t lastsync = 0; // the palm's last sync date, as set by that sync
+    uint64_t fingerprint = 0; // of every record to be written, and the settings they were written with
+    unsigned long modnum = 0; // the datebook's modification number and date, which change with any edit
+    time_t modified = 0;
+};
+
+bool LoadSyncState(const std::string &filename, SyncState &state) {
+    FILE *file = fopen(filename.c_str(), "r");
+    if (file == nullptr) {
+        return false;
+    }
+    long long lastsync, modified;
+    unsigned long long fingerprint;
+    bool valid = fscanf(file, "lastsync %lld\nfingerprint %llx\nmodnum %lu\nmodified %lld\n",
+        &lastsync, &fingerprint, &state.modnum, &modified) == 4;
+    state.lastsync = lastsync;
+    state.fingerprint = fingerprint;
+    state.modified = modified;
+    fclose(file);
+    return valid;
+}
+
+bool SaveSyncState(const std::string &filename, const SyncState &state) {
+    FILE *file = fopen(filename.c_str(), "w");
+    if (file == nullptr) {
+        return false;
+    }
+    fprintf(file, "lastsync %lld\nfingerprint %016llx\nmodnum %lu\nmodified %lld\n", (long long)state.lastsync,
+        (unsigned long long)state.fingerprint, state.modnum, (long long)state.modified);
+    return fclose(file) == 0;
+}
+
+// whether the datebook is just as the last sync left it, and that sync wrote what fingerprint says is to be written
+bool AlreadySynced(int sd, const std::string &filename, const PilotUser &user, uint64_t fingerprint) {
+    DBInfo info;
+    SyncState last;
+    return DLP(dlp_FindDBByName(sd, 0, "DatebookDB", nullptr, nullptr, &info, nullptr), 0, sizeof(info)) >= 0 &&
+        LoadSyncState(filename, last) && last.lastsync == user.lastSyncDate && last.fingerprint == fingerprint &&
+        last.modnum == info.modnum && last.modified == info.modifyDate;
+}
+
+
+/** planning a sync **/
+
+// what a sync is going to do to the palm and how long that should take, worked out before connecting to it
+// from the converted calendar, what the last sync wrote, and how fast the link was last time
+
+// calls every sync makes whatever it writes: opening, tidying, and closing the datebook, the user info, logging
+#define PLAN_FIXED_CALLS 10
+// timed calls needed before the link speed measured during a sync is trusted over the last one
+#define PLAN_MIN_SAMPLES 10
+// seconds between progress updates while writing
+#define PROGRESS_INTERVAL 5
+
+// the records written by the last successful sync, as the calendar (hash of its URI) and a hash of the
+// packed record, kept by the palm's user name (all that's known without the palm, e.g., with -P), and
+// again as written-last for planning without knowing which palm it's for
+std::string PlanFile(const std::string &directory, const std::string &user) {
+    char name[64];
+    snprintf(name, sizeof(name), "written-%016llx", (unsigned long long)Hash64(user));
+    return (std::filesystem::path(directory) / name).string();
+}
+
+bool LoadWritten(const std::string &filename, std::vector<std::pair<uint64_t, uint64_t>> &records) {
+    FILE *file = fopen(filename.c_str(), "r");
+    if (file == nullptr) {
+        return false;
+    }
+    unsigned long long calendar, record;
+    while (fscanf(file, "%llx %llx\n", &calendar, &record) == 2) {
+        records.emplace_back(calendar, record);
+    }
+    fclose(file);
+    return true;
+}
+
+bool SaveWritten(const std::string &filename, const std::vector<std::pair<uint64_t, uint64_t>> &records) {
+    FILE *file = fopen(filename.c_str(), "w");
+    if (file == nullptr) {
+        return false;
+    }
+    for (const auto &[calendar, record] : records) {
+        fprintf(file, "%016llx %016llx\n", (unsigned long long)calendar, (unsigned long long)record);
+    }
+    return fclose(file) == 0;
+}
+
+struct SyncPlan {
+    int adds = 0; // records that aren't on the palm yet
+    int rewrites = 0; // records that are, but get deleted and written again (the palm has no update)
+    int deletes = 0; // records taken off the palm
+    int reads = 0; // records read back from the palm to merge with
+    size_t bytes = 0; // packed records sent to the palm
+    long calls = 0; // DLP calls
+    std::vector<std::pair<uint64_t, uint64_t>> records; // everything to be on the palm, by calendar and hash
+
+    // each appointment packed for the palm (nullptr if it isn't to be copied) and its hash, kept for writing
+    std::vector<pi_buffer_t*> packed;
+    std::vector<uint64_t> hashes;
+    int truncated = 0; // notes cut down for records to fit
+    int dropped = 0; // records too big even so, which are no longer marked in docopy
+};
+
+// plan writing the appointments marked in docopy to a palm that has previous on it (from LoadWritten)
+// it can only be an estimate, the palm may have changed since, and merging matches on the start and summary
+// rather than the whole record (utf8 is passed on to TruncateNote)
+SyncPlan PlanSync(std::vector<Appointment> &appointments, std::vector<bool> &docopy, const std::vector<int> &sources,
+        const std::vector<std::string> &uris, const std::vector<std::pair<uint64_t, uint64_t>> &previous,
+        bool overwrite, bool onlynew, bool categories, bool utf8) {
+    SyncPlan plan;
+
+    std::vector<uint64_t> calendars;
+    for (const std::string &uri : uris) {
+        calendars.push_back(Hash64(uri));
+    }
+
+    // what was there last time, to be matched off against what's to be written
+    auto key = [](uint64_t calendar, uint64_t record) { return Hash64(std::string_view((char*)&record, sizeof(record)), calendar); };
+    std::unordered_map<uint64_t, int> remaining;
+    for (const auto &[calendar, record] : previous) {
+        remaining[key(calendar, record)]++;
+    }
+
+    plan.packed.resize(appointments.size(), nullptr);
+    plan.hashes.resize(appointments.size(), 0);
+    std::vector<bool> unchanged(appointments.size(), false);
+    std::unordered_map<uint64_t, int> changed; // calendars with records added or gone, and how many were there
+    for (int i = 0; i < appointments.size(); i++) {
+        if (!docopy[i]) {
+            continue;
+        }
+        pi_buffer_t *packed = PackAppointment(appointments[i], plan.truncated, utf8);
+        if (packed == nullptr) {
+            docopy[i] = false;
+            plan.dropped++;
+            continue;
+        }
+        uint64_t calendar = calendars[sources[i]], hash = Hash64(std::string_view((char*)packed->data, packed->used));
+        plan.packed[i] = packed;
+        plan.hashes[i] = hash;
+        plan.records.emplace_back(calendar, hash);
+
+        auto found = remaining.find(key(calendar, hash));
+        if (found != remaining.end() && found->second > 0) {
+            found->second--;
+            unchanged[i] = true;
+        }
+        else {
+            changed[calendar];
+        }
+    }
+
+    // and what was there that isn't any more
+    for (const auto &[calendar, record] : previous) {
+        auto found = remaining.find(key(calendar, record));
+        if (found->second > 0) {
+            found->second--;
+            changed[calendar];
+        }
+    }
+    for (const auto &[calendar, record] : previous) {
+        auto found = changed.find(calendar);
+        if (found != changed.end()) {
+            found->second++;
+        }
+    }
+
+    for (int i = 0; i < appointments.size(); i++) {
+        if (!docopy[i]) {
+            continue;
+        }
+        bool write = overwrite && categories ? changed.count(calendars[sources[i]]) > 0 : overwrite || !onlynew || !unchanged[i];
+        if (write) {
+            (unchanged[i] ? plan.rewrites : plan.adds)++;
+            plan.bytes += plan.packed[i]->used;
+            plan.calls++;
+        }
+    }
+
+    if (overwrite && categories) {
+        // each changed calendar's category is deleted in one go
+        for (uint64_t calendar : calendars) {
+            auto found = changed.find(calendar);
+            if (found != changed.end()) {
+                plan.deletes += found->second;
+                plan.calls++;
+                changed.erase(found); // the same calendar may be listed twice
+            }
+        }
+    }
+    else if (overwrite) {
+        // the whole datebook is deleted in one go
+        plan.deletes = previous.size();
+        plan.calls++;
+    }
+    else {
+        // every record is read back, and the ones being written again deleted one by one
+        plan.reads = previous.size();
+        plan.deletes = onlynew ? 0 : plan.rewrites;
+        plan.calls += 1 + plan.reads + plan.deletes;
+    }
+    plan.calls += PLAN_FIXED_CALLS;
+
+    return plan;
+}
+
+// how long the link to the palm takes for each call and for each byte sent or received, kept in STATEDIR
+// (for all palms, it's the cable or cradle and the serial rate that decide it)
+struct LinkSpeed {
+    double percall = 0; // seconds
+    double perbyte = 0;
+    long samples = 0; // the calls it was measured over, 0 if it hasn't been
+};
+
+bool LoadLinkSpeed(const std::string &filename, LinkSpeed &speed) {
+    FILE *file = fopen(filename.c_str(), "r");
+    if (file == nullptr) {
+        return false;
+    }
+    bool valid = fscanf(file, "percall %lf\nperbyte %lf\nsamples %ld\n", &speed.percall, &speed.perbyte, &speed.samples) == 3;
+    fclose(file);
+    if (!valid) {
+        speed = LinkSpeed();
+    }
+    return valid;
+}
+
+bool SaveLinkSpeed(const std::string &filename, const LinkSpeed &speed) {
+    FILE *file = fopen(filename.c_str(), "w");
+    if (file == nullptr) {
+        return false;
+    }
+    fprintf(file, "percall %.9f\nperbyte %.12f\nsamples %ld\n", speed.percall, speed.perbyte, speed.samples);
+    return fclose(file) == 0;
+}
+
+// seconds for calls moving bytes over a link
+double EstimateSeconds(const LinkSpeed &speed, long calls, size_t bytes) {
+    return calls * speed.percall + bytes * speed.perbyte;
+}
+
+// times calls to the palm during a sync to work out the link speed, with a least squares fit of the
+// time each call took against the bytes it moved
+class LinkMeter {
+    public:
+        // note a call that started at start (and has just finished) that moved bytes
+        void add(size_t bytes, std::chrono::steady_clock::time_point start) {
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            double x = bytes, y = elapsed.count();
+            n++;
+            sx += x;
+            sy += y;
+            sxx += x * x;
+            sxy += x * y;
+        }
+
+        LinkSpeed speed() const {
+            LinkSpeed speed;
+            speed.samples = n;
+            if (n == 0) {
+                return speed;
+            }
+            double spread = n * sxx - sx * sx;
+            speed.perbyte = spread > 0 ? std::max(0.0, (n * sxy - sx * sy) / spread) : 0; // all the same size, no slope
+            speed.percall = std::max(0.0, (sy - speed.perbyte * sx) / n);
+            return speed;
+        }
+
+    private:
+        long n = 0;
+        double sx = 0, sy = 0, sxx = 0, sxy = 0;
+};
+
+// print a plan, with how long it should take if the link speed is known
+void PrintPlan(const SyncPlan &plan, const LinkSpeed &speed) {
+    std::cout << "    " << plan.adds << " records to add, " << plan.rewrites << " to rewrite, " << plan.deletes << " to delete";
+    if (plan.reads > 0) {
+        std::cout << ", " << plan.reads << " to read back";
+    }
+    std::cout << std::endl << "    " << plan.bytes << " bytes to send in about " << plan.calls << " DLP calls" << std::endl;
+    if (speed.samples > 0) {
+        char line[128];
+        snprintf(line, sizeof(line), "    Should take about %.0f seconds (%.1f ms a call, %.0f bytes/s last time)",
+            EstimateSeconds(speed, plan.calls, plan.bytes), speed.percall * 1e3, speed.perbyte > 0 ? 1 / speed.perbyte : 0.0);
+        std::cout << line << std::endl;
+    }
+    else {
+        std::cout << "    No link speed measured yet to estimate how long that will take" << std::endl;
+    }
+}
+
+// progress writing records to the palm with an estimate of the time left, printed every PROGRESS_INTERVAL
+// seconds, from the link speed measured so far or last time until there's enough of this sync to go on
+class WriteProgress {
+    public:
+        WriteProgress(int records, size_t bytes, const LinkSpeed &previous, const LinkMeter &meter) :
+            records(records), bytes(bytes), previous(previous), meter(meter) {}
+
+        void written(size_t length) {
+            numwritten++;
+            byteswritten += length;
+            auto now = std::chrono::steady_clock::now();
+            if (now - last < std::chrono::seconds(PROGRESS_INTERVAL) || numwritten >= records) {
+                return;
+            }
+            last = now;
+
+            LinkSpeed speed = meter.speed();
+            if (speed.samples < PLAN_MIN_SAMPLES) {
+                speed = previous;
+            }
+            std::cout << std::endl << "        " << numwritten << " of " << records << " written (" <<
+                numwritten * 100 / records << "%)";
+            if (speed.samples > 0) {
+                double left = EstimateSeconds(speed, records - numwritten, bytes > byteswritten ? bytes - byteswritten : 0);
+                std::cout << ", about " << (long)(left + 0.5) << " seconds left";
+            }
+            std::cout << std::flush;
+            printed = true;
+        }
+
+        // the finishing message goes on a line of its own after any progress
+        void finish() {
+            if (printed) {
+                std::cout << std::endl << "    ";
+            }
+        }
+
+    private:
+        int records, numwritten = 0;
+        size_t bytes, byteswritten = 0;
+        LinkSpeed previous;
+        const LinkMeter &meter;
+        std::chrono::steady_clock::time_point last = std::chrono::steady_clock::now();
+        bool printed = false;
+};
+
+
+// the last copy of a calendar that was fetched successfully, to fall back on if fetching it fails
+std::string FeedFile(const std::string &directory, const std::string &uri) {
+    char name[64];
+    snprintf(name, sizeof(name), "feed-%016llx.ics", (unsigned long long)Hash64(uri));
+    return (std::filesystem::path(directory) / name).string();
+}
+
+bool ReadWholeFile(const std::string &filename, std::string &data) {
+    FILE *file = fopen(filename.c_str(), "rb");
+    if (file == nullptr) {
+        return false;
+    }
+    data.clear();
+    char buffer[65536];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        data.append(buffer, n);
+    }
+    bool failed = ferror(file);
+    fclose(file);
+    return !failed;
+}
+
+// written alongside and renamed into place, so there's always a complete copy
+bool WriteWholeFile(const std::string &filename, const std::string &data) {
+    std::string temporary = filename + ".new";
+    FILE *file = fopen(temporary.c_str(), "wb");
+    if (file == nullptr) {
+        return false;
+    }
+    bool failed = fwrite(data.data(), 1, data.length(), file) != data.length();
+    if (fclose(file) != 0 || failed || rename(temporary.c_str(), filename.c_str()) != 0) {
+        remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+
+/** prepared profiles **/
+
+// with -P a palm user's calendar is kept in STATEDIR exactly as it will be written, keyed by a hash of the
+// settings that went into it and another of those and the calendars it was made from, so that when that
+// palm connects it can be written straight away if it was prepared recently enough, or once the calendars
+// have been fetched if they haven't changed, with nothing to parse or convert
+// (only ever read back on the same machine, so numbers are kept in their native form)
+
+#define PREPARED_MAGIC "SC2PREP2"
+
+// the date in the given time zone as yyyymmdd, for the settings key as the sync window starts from today
+long LocalDate(time_t when, const std::string &timezone) {
+    const char *tz = getenv("TZ");
+    std::string oldtz = tz != nullptr ? tz : "";
+    setenv("TZ", timezone.c_str(), 1);
+    tzset();
+    tm local = *localtime(&when);
+    if (tz != nullptr) {
+        setenv("TZ", oldtz.c_str(), 1);
+    }
+    else {
+        unsetenv("TZ");
+    }
+    tzset();
+    return (local.tm_year + 1900) * 10000L + (local.tm_mon + 1) * 100 + local.tm_mday;
+}
+
+std::string PreparedFile(const std::string &directory, const std::string &user) {
+    char name[64];
+    snprintf(name, sizeof(name), "prepared-%016llx", (unsigned long long)Hash64(user));
+    return (std::filesystem::path(directory) / name).string();
+}
+
+// save the packed records (nullptr for those not to be copied) with the calendar each came from
+bool SavePrepared(const std::string &filename, uint64_t settingskey, uint64_t contentkey, const std::vector<bool> &fetched,
+        const std::vector<pi_buffer_t*> &packed, const std::vector<int> &sources) {
+    std::string data(PREPARED_MAGIC);
+    auto append = [&data](const void *p, size_t length) { data.append((const char*)p, length); };
+    uint32_t numsources = fetched.size(), count = 0;
+    append(&settingskey, sizeof(settingskey));
+    append(&contentkey, sizeof(contentkey));
+    append(&numsources, sizeof(numsources));
+    for (bool f : fetched) {
+        data.push_back(f);
+    }
+    for (pi_buffer_t *record : packed) {
+        count += record != nullptr;
+    }
+    append(&count, sizeof(count));
+    for (int i = 0; i < packed.size(); i++) {
+        if (packed[i] != nullptr) {
+            uint32_t source = sources[i], length = packed[i]->used;
+            append(&source, sizeof(source));
+            append(&length, sizeof(length));
+            append(packed[i]->data, length);
+        }
+    }
+    return WriteWholeFile(filename, data);
+}
+
+// read back what SavePrepared wrote as new appointments, returns false (having added nothing) if it
+// isn't there or was prepared with other settings or from other calendars (contentkey 0 to take it whatever
+// calendars it was prepared from, when it's recent enough for that not to matter)
+bool LoadPrepared(const std::string &filename, uint64_t settingskey, uint64_t contentkey, std::vector<Appointment> &appointments,
+        std::vector<bool> &docopy, std::vector<int> &sources, std::vector<bool> &fetched) {
+    std::string data;
+    if (!ReadWholeFile(filename, data)) {
+        return false;
+    }
+
+    size_t at = 8;
+    auto read = [&data, &at](void *p, size_t length) {
+        if (at + length > data.length()) {
+            return false;
+        }
+        memcpy(p, data.data() + at, length);
+        at += length;
+        return true;
+    };
+    uint64_t savedsettings, savedcontent;
+    uint32_t numsources, count;
+    if (data.compare(0, 8, PREPARED_MAGIC) != 0 || !read(&savedsettings, sizeof(savedsettings)) || savedsettings != settingskey ||
+            !read(&savedcontent, sizeof(savedcontent)) || (contentkey != 0 && savedcontent != contentkey) ||
+            !read(&numsources, sizeof(numsources)) || numsources != fetched.size() || at + numsources > data.length()) {
+        return false;
+    }
+    std::vector<bool> wasfetched(data.begin() + at, data.begin() + at + numsources);
+    at += numsources;
+
+    std::vector<Appointment> loaded;
+    std::vector<int> loadedsources;
+    bool valid = read(&count, sizeof(count));
+    for (uint32_t i = 0; valid && i < count; i++) {
+        uint32_t source, length;
+        valid = read(&source, sizeof(source)) && read(&length, sizeof(length)) && source < numsources &&
+            at + length <= data.length();
+        if (valid) {
+            pi_buffer_t record = {(unsigned char*)data.data() + at, length, length};
+            Appointment appointment;
+            valid = unpack_Appointment(&appointment, &record, datebook_v1) >= 0;
+            at += length;
+            if (valid) {
+                loaded.push_back(appointment);
+                loadedsources.push_back(source);
+            }
+        }
+    }
+    if (!valid) {
+        for (Appointment &appointment : loaded) {
+            free_Appointment(&appointment);
+        }
+        return false;
+    }
+
+    appointments.insert(appointments.end(), loaded.begin(), loaded.end());
+    sources.insert(sources.end(), loadedsources.begin(), loadedsources.end());
+    docopy.insert(docopy.end(), loaded.size(), true);
+    fetched = wasfetched;
+    return true;
+}
+
+
+/** categories **/
+
+// a name for each calendar's category, from the end of its URI (e.g., .../work.ics is "work")
+// palm category names are at most 15 characters, so they're cut short and numbered if that makes them the same
+std::vector<std::string> CategoryNames(const std::vector<std::string> &uris) {
+    std::vector<std::string> names;
+    for (int i = 0; i < uris.size(); i++) {
+        std::string_view uri = uris[i];
+        uri = uri.substr(0, uri.find_first_of("?#"));
+        while (uri.length() > 0 && uri.back() == '/') {
+            uri.remove_suffix(1);
+        }
+        std::string_view base = uri.substr(uri.find_last_of('/') + 1);
+        std::string name(base.substr(0, std::min(base.find('.'), (size_t)15)));
+        if (name.length() == 0 || name == "-") {
+            name = "Calendar " + std::to_string(i + 1);
+        }
+        if (std::find(names.begin(), names.end(), name) != names.end()) {
+            std::string number = " " + std::to_string(i + 1);
+            name = name.substr(0, 15 - number.length()) + number;
+        }
+        names.push_back(name);
+    }
+    return names;
+}
+
+// find a category by name in an AppInfo block, adding it if it isn't there (and setting changed)
+// returns the category's index, or -1 if it isn't there and all 15 are in use
+int FindCategory(CategoryAppInfo &category, const std::string &name, bool &changed) {
+    // 0 is Unfiled, which is left for events made on the palm
+    for (int i = 1; i < 16; i++) {
+        if (strncmp(category.name[i], name.c_str(), sizeof(category.name[i])) == 0) {
+            return i;
+        }
+    }
+
+    for (int i = 1; i < 16; i++) {
+        if (category.name[i][0] != '\0') {
+            continue;
+        }
+        strncpy(category.name[i], name.c_str(), sizeof(category.name[i]) - 1);
+        category.name[i][sizeof(category.name[i]) - 1] = '\0';
+        category.renamed[i] = 1;
+
+        // categories made on the desktop have IDs from 128, and they need to be unique
+        int id = std::max(128, category.lastUniqueID + 1);
+        for (int tries = 0; tries < 128; tries++, id++) {
+            if (id > 255) {
+                id = 128;
+            }
+            bool used = false;
+            for (int j = 0; j < 16; j++) {
+                used = used || (category.ID[j] == id && category.name[j][0] != '\0' && j != i);
+            }
+            if (!used) {
+                break;
+            }
+        }
+        category.ID[i] = id;
+        category.lastUniqueID = id;
+
+        changed = true;
+        return i;
+    }
+    return -1;
+}
+
+
+/** pipelining **/
+
+// with OVERWRITE (and without CATEGORIES) records are written to the palm as the calendars are converted,
+// a chunk of events at a time, handed from the conversion to a thread writing them through a queue
+
+#define PIPELINE_CHUNK 256 // events converted at a time before the finished ones are queued
+#define PIPELINE_QUEUE 64 // records waiting to be written, at most
+
+// a packed record on its way to the palm, a nullptr record marks the end
+struct PipelineRecord {
+    pi_buffer_t *record = nullptr;
+    uint64_t calendar = 0, hash = 0; // for the sync plan and checkpoint
+};
+
+// a fixed size queue between one thread putting things in and another taking them out, without locks
+// (each side only moves its own end along), push and pop wait if it's full or empty
+template <typename T, size_t N>
+class SPSCQueue {
+    public:
+        void push(T item) {
+            size_t tail = tails.load(std::memory_order_relaxed);
+            for (int spins = 0; tail - heads.load(std::memory_order_acquire) == N; spins++) {
+                wait(spins);
+            }
+            items[tail % N] = std::move(item);
+            tails.store(tail + 1, std::memory_order_release);
+        }
+
+        T pop() {
+            size_t head = heads.load(std::memory_order_relaxed);
+            for (int spins = 0; tails.load(std::memory_order_acquire) == head; spins++) {
+                wait(spins);
+            }
+            T item = std::move(items[head % N]);
+            heads.store(head + 1, std::memory_order_release);
+            return item;
+        }
+
+    private:
+        T items[N];
+        std::atomic<size_t> heads{0}, tails{0}; // how many have been taken out and put in, ever
+
+        // the other side is usually only a moment away, but if it's waiting on the palm or converting a
+        // chunk of events it could be a while, so back off to sleeping rather than spinning
+        static void wait(int spins) {
+            if (spins < 64) {
+                std::this_thread::yield();
+            }
+            else {
+                std::this_thread::sleep_for(std::chrono::microseconds(spins < 1024 ? 50 : 1000));
+            }
+        }
+};
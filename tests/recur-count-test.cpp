@@ -0,0 +1,166 @@
+/*
+ *
+ * Copyright (C) 2023 guruthree
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+// checks LastOccurrence against libical stepping through the occurrences of randomly made up RRULEs,
+// for the repeat patterns the palm has (the ones sync-calendar2 converts rather than expands)
+// usage: recur-count-test [cases] [seed]
+
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+
+#include <libical/ical.h>
+
+#include "../recur-count.h"
+
+const char *DayNames[7] = {"SU", "MO", "TU", "WE", "TH", "FR", "SA"};
+
+int main(int argc, char **argv) {
+    long cases = argc > 1 ? atol(argv[1]) : 20000;
+    unsigned seed = argc > 2 ? atoi(argv[2]) : 2023;
+    std::mt19937 random(seed);
+    auto between = [&](long low, long high) { return std::uniform_int_distribution<long>(low, high)(random); };
+
+    long failures = 0;
+    for (long n = 0; n < cases; n++) {
+
+        // a start date, with the rule made to include it as calendar programs do
+        long y = between(1980, 2030), m = between(1, 12), d = between(1, DaysInMonth(y, m));
+        if (between(0, 19) == 0) { // plenty of leap days, they're the awkward ones
+            y = between(495, 507) * 4;
+            m = 2;
+            d = 29;
+        }
+        long start = DaysFromCivil(y, m, d);
+        int weekday = WeekdayOfDays(start);
+        long interval = between(1, 12), count = between(1, 400);
+        if (between(0, 3) == 0) {
+            count = between(1, 5);
+        }
+
+        Appointment appointment = {};
+        appointment.begin.tm_year = y - 1900;
+        appointment.begin.tm_mon = m - 1;
+        appointment.begin.tm_mday = d;
+        appointment.begin.tm_wday = weekday;
+        appointment.repeatFrequency = interval;
+
+        std::string rule = "FREQ=";
+        switch (between(0, 4)) {
+            case 0:
+                rule += "DAILY";
+                appointment.repeatType = repeatDaily;
+                break;
+            case 1: {
+                int weekstart = between(0, 1) ? 1 : 0;
+                rule += "WEEKLY;WKST=" + std::string(DayNames[weekstart]) + ";BYDAY=";
+                appointment.repeatType = repeatWeekly;
+                appointment.repeatWeekstart = weekstart;
+                appointment.repeatDays[weekday] = 1;
+                for (int i = 0; i < 7; i++) {
+                    if (between(0, 2) == 0) {
+                        appointment.repeatDays[i] = 1;
+                    }
+                }
+                bool first = true;
+                for (int i = 0; i < 7; i++) {
+                    if (appointment.repeatDays[i]) {
+                        rule += (first ? "" : ",") + std::string(DayNames[i]);
+                        first = false;
+                    }
+                }
+                break;
+            }
+            case 2:
+                rule += "MONTHLY;BYMONTHDAY=" + std::to_string(d);
+                appointment.repeatType = repeatMonthlyByDate;
+                appointment.repeatDay = (DayOfMonthType)d;
+                break;
+            case 3: {
+                // the nth weekday of the month, the start being the one it's on, or the last one if it's
+                // in the last week (the palm's 5th is the last, as not every month has a 5th)
+                int week = (d - 1) / 7;
+                appointment.repeatType = repeatMonthlyByDay;
+                if (d + 7 > DaysInMonth(y, m) && (week == 4 || between(0, 1) == 0)) {
+                    rule += "MONTHLY;BYDAY=-1" + std::string(DayNames[weekday]);
+                    appointment.repeatDay = (DayOfMonthType)(28 + weekday);
+                }
+                else {
+                    rule += "MONTHLY;BYDAY=" + std::to_string(week + 1) + DayNames[weekday];
+                    appointment.repeatDay = (DayOfMonthType)(week * 7 + weekday);
+                }
+                break;
+            }
+            default:
+                rule += "YEARLY";
+                appointment.repeatType = repeatYearly;
+                break;
+        }
+        rule += ";INTERVAL=" + std::to_string(interval) + ";COUNT=" + std::to_string(count);
+
+        // what libical makes of it, stopping once it's past the end of the palm's calendar
+        icaltimetype dtstart = icaltime_null_date();
+        dtstart.year = y;
+        dtstart.month = m;
+        dtstart.day = d;
+        icalrecurrencetype recur = icalrecurrencetype_from_string(rule.c_str());
+        icalrecur_iterator *iterator = icalrecur_iterator_new(recur, dtstart);
+        if (iterator == nullptr) {
+            printf("libical couldn't iterate %s from %04ld-%02ld-%02ld\n", rule.c_str(), y, m, d);
+            failures++;
+            continue;
+        }
+        icaltimetype last = icaltime_null_date();
+        long seen = 0;
+        for (icaltimetype t = icalrecur_iterator_next(iterator); !icaltime_is_null_time(t); t = icalrecur_iterator_next(iterator)) {
+            last = t;
+            seen++;
+            if (t.year > PALM_LAST_YEAR) {
+                break;
+            }
+        }
+        icalrecur_iterator_free(iterator);
+        bool expected = seen == count && last.year <= PALM_LAST_YEAR;
+
+        tm end = {};
+        bool found = LastOccurrence(appointment, count, end);
+        if (found != expected || (found && (end.tm_year + 1900 != last.year || end.tm_mon + 1 != last.month || end.tm_mday != last.day))) {
+            printf("%s from %04ld-%02ld-%02ld: libical ", rule.c_str(), y, m, d);
+            if (expected) {
+                printf("%04d-%02d-%02d", last.year, last.month, last.day);
+            }
+            else {
+                printf("past %d", PALM_LAST_YEAR);
+            }
+            printf(", LastOccurrence ");
+            if (found) {
+                printf("%04d-%02d-%02d\n", end.tm_year + 1900, end.tm_mon + 1, end.tm_mday);
+            }
+            else {
+                printf("past %d\n", PALM_LAST_YEAR);
+            }
+            failures++;
+        }
+    }
+
+    printf("%ld of %ld cases differ (seed %u)\n", failures, cases, seed);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}